@@ -0,0 +1,198 @@
+// Read throughput of ConcurrentVirusGenealogy for 1 to 64 reader threads,
+// compared with a VirusGenealogy guarded by a single std::mutex.
+//
+//   cmake -S bench -B build/bench && cmake --build build/bench
+//   build/bench/concurrent_reads [nodes] [milliseconds] [max_threads] [--writer]
+//
+// Every reader repeatedly looks up a random virus and reads its parents and
+// children. With --writer, one more thread keeps creating and removing
+// viruses for the whole measurement.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "concurrent_virus_genealogy.h"
+
+namespace {
+
+class Virus {
+  public:
+    using id_type = std::uint64_t;
+
+    explicit Virus(id_type id) : id(id) {
+    }
+
+    id_type get_id() const {
+        return id;
+    }
+
+  private:
+    id_type id;
+};
+
+using Storage = HashStorage;
+using Edges = std::vector<std::pair<Virus::id_type, Virus::id_type>>;
+
+// One query: the virus, its parents and its children.
+std::size_t query(VirusGenealogy<Virus, Storage> const &genealogy, Virus::id_type id) {
+    if (!genealogy.exists(id)) {
+        return 0;
+    }
+    std::size_t sum = genealogy[id].get_id() + genealogy.get_parents(id).size();
+    for (Virus const &child : genealogy.children(id)) {
+        sum += child.get_id();
+    }
+    return sum;
+}
+
+// The baseline the concurrent wrapper replaces: every call under one mutex.
+class MutexGenealogy {
+  public:
+    MutexGenealogy(Virus::id_type stem_id, Edges const &edges)
+        : genealogy(stem_id, edges) {
+    }
+
+    std::size_t read(Virus::id_type id) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return query(genealogy, id);
+    }
+
+    void create(Virus::id_type id, Virus::id_type parent_id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        genealogy.create(id, parent_id);
+    }
+
+    void remove(Virus::id_type id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        genealogy.remove(id);
+    }
+
+  private:
+    mutable std::mutex mutex;
+    VirusGenealogy<Virus, Storage> genealogy;
+};
+
+class SharedGenealogy {
+  public:
+    SharedGenealogy(Virus::id_type stem_id, Edges const &edges)
+        : genealogy(stem_id, edges) {
+    }
+
+    std::size_t read(Virus::id_type id) const {
+        // One shared lock for the whole query, as the mutex baseline takes one.
+        return genealogy.read([id](VirusGenealogy<Virus, Storage> const &locked) {
+            return query(locked, id);
+        });
+    }
+
+    void create(Virus::id_type id, Virus::id_type parent_id) {
+        genealogy.create(id, parent_id);
+    }
+
+    void remove(Virus::id_type id) {
+        genealogy.remove(id);
+    }
+
+  private:
+    ConcurrentVirusGenealogy<Virus, Storage> genealogy;
+};
+
+Edges random_edges(std::size_t nodes) {
+    std::mt19937_64 random(1);
+    Edges edges;
+    edges.reserve(nodes + nodes / 4);
+    for (Virus::id_type id = 1; id < nodes; ++id) {
+        edges.emplace_back(id, random() % id);
+        if (id % 4 == 0) {
+            edges.emplace_back(id, random() % id);
+        }
+    }
+    return edges;
+}
+
+// Returns reads per second summed over all readers.
+template <typename Genealogy>
+double measure(Genealogy &genealogy, std::size_t nodes, std::size_t readers,
+               std::chrono::milliseconds duration, bool writer) {
+    std::atomic<bool> start{false};
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> total{0};
+    std::atomic<std::size_t> sink{0};
+
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < readers; ++t) {
+        threads.emplace_back([&, t] {
+            std::mt19937_64 random(t + 2);
+            std::uint64_t reads = 0;
+            std::size_t sum = 0;
+            while (!start.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 64; ++i) {
+                    sum += genealogy.read(random() % nodes);
+                }
+                reads += 64;
+            }
+            total.fetch_add(reads);
+            sink.fetch_add(sum);
+        });
+    }
+    if (writer) {
+        threads.emplace_back([&] {
+            std::mt19937_64 random(1);
+            Virus::id_type next = nodes;
+            while (!start.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            while (!stop.load(std::memory_order_relaxed)) {
+                genealogy.create(next, random() % nodes);
+                genealogy.remove(next);
+                ++next;
+            }
+        });
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(duration);
+    stop.store(true);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    return static_cast<double>(total.load()) / std::chrono::duration<double>(end - begin).count();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::size_t nodes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::chrono::milliseconds duration(argc > 2 ? std::strtoll(argv[2], nullptr, 10) : 1000);
+    std::size_t max_threads = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 64;
+    bool writer = argc > 4 && std::strcmp(argv[4], "--writer") == 0;
+
+    auto edges = random_edges(nodes);
+    MutexGenealogy locked(0, edges);
+    SharedGenealogy shared(0, edges);
+
+    std::printf("%zu viruses, %u hardware threads%s\n", nodes, std::thread::hardware_concurrency(),
+                writer ? ", one writer" : "");
+    std::printf("%8s %16s %16s %8s\n", "readers", "mutex reads/s", "shared reads/s", "speedup");
+    for (std::size_t readers = 1; readers <= max_threads; readers *= 2) {
+        double baseline = measure(locked, nodes, readers, duration, writer);
+        double concurrent = measure(shared, nodes, readers, duration, writer);
+        std::printf("%8zu %16.0f %16.0f %8.2f\n", readers, baseline, concurrent, concurrent / baseline);
+    }
+}
@@ -0,0 +1,111 @@
+// Throughput of VirusGenealogy::lowest_common_ancestors() over batches of
+// random pairs, on genealogies of different shapes.
+//
+//   cmake -S bench -B build/bench && cmake --build build/bench
+//   build/bench/lowest_common_ancestors [nodes] [pairs]
+//
+// The indexes are built lazily by the first queries that need them, after
+// the genealogy is loaded; their cost is included in the batch time.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "virus_genealogy.h"
+
+namespace {
+
+class Virus {
+  public:
+    using id_type = std::uint64_t;
+
+    explicit Virus(id_type id) : id(id) {
+    }
+
+    id_type get_id() const {
+        return id;
+    }
+
+  private:
+    id_type id;
+};
+
+using Genealogy = VirusGenealogy<Virus, HashStorage>;
+using Edges = std::vector<std::pair<Virus::id_type, Virus::id_type>>;
+
+// A single line of descent.
+Edges chain(std::size_t nodes) {
+    Edges edges;
+    for (Virus::id_type id = 1; id < nodes; ++id) {
+        edges.emplace_back(id, id - 1);
+    }
+    return edges;
+}
+
+// A random tree whose parents are mostly recent, so that lineages are deep.
+Edges deep_tree(std::size_t nodes) {
+    std::mt19937_64 random(1);
+    Edges edges;
+    for (Virus::id_type id = 1; id < nodes; ++id) {
+        Virus::id_type span = std::min<Virus::id_type>(id, 16);
+        edges.emplace_back(id, id - 1 - random() % span);
+    }
+    return edges;
+}
+
+// A random tree in which every twentieth virus is a recombinant of two.
+Edges recombinant(std::size_t nodes) {
+    std::mt19937_64 random(2);
+    Edges edges;
+    for (Virus::id_type id = 1; id < nodes; ++id) {
+        edges.emplace_back(id, random() % id);
+        if (id % 20 == 0) {
+            edges.emplace_back(id, random() % id);
+        }
+    }
+    return edges;
+}
+
+void measure(char const *name, Edges const &edges, std::size_t nodes, std::size_t pairs) {
+    Genealogy genealogy(0, edges);
+    std::mt19937_64 random(3);
+    std::vector<std::pair<Virus::id_type, Virus::id_type>> batch(pairs);
+    for (auto &[a, b] : batch) {
+        a = random() % nodes;
+        b = random() % nodes;
+    }
+
+    std::size_t sink = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (auto const &[a, b] : batch) {
+        sink += genealogy.lowest_common_ancestors(a, b).size();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    double per_pair = seconds * 1e6 / static_cast<double>(batch.size());
+    std::printf("%-12s %10.2f %10.3f %12.0f %10zu\n", name, seconds, per_pair,
+                static_cast<double>(batch.size()) / seconds, sink);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::size_t nodes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::size_t pairs = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    if (nodes < 2 || pairs < 1) {
+        std::fprintf(stderr, "need at least 2 nodes and 1 pair\n");
+        return 1;
+    }
+
+    std::printf("%zu viruses, %zu pairs per batch\n", nodes, pairs);
+    std::printf("%-12s %10s %10s %12s %10s\n", "shape", "batch s", "us/pair", "pairs/s", "results");
+    measure("chain", chain(nodes), nodes, pairs);
+    measure("deep tree", deep_tree(nodes), nodes, pairs);
+    measure("recombinant", recombinant(nodes), nodes, pairs);
+}
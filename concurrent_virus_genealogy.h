@@ -0,0 +1,150 @@
+#ifndef CONCURRENT_VIRUS_GENEALOGY_H
+#define CONCURRENT_VIRUS_GENEALOGY_H
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "virus_genealogy.h"
+
+// Genealogia wirusów bezpieczna przy użyciu z wielu wątków. Odczyty
+// wykonują się współbieżnie pod blokadą współdzieloną, a modyfikacje pod
+// blokadą wyłączną. Metody zwracają kopie danych lub wskaźniki
+// współdzielące własność wirusów, nigdy iteratorów ani referencji do
+// wnętrza genealogii, które mogłyby zostać unieważnione przez inny wątek.
+template <typename Virus, typename Storage = OrderedStorage>
+class ConcurrentVirusGenealogy {
+  public:
+    using genealogy_type = VirusGenealogy<Virus, Storage>;
+
+    ConcurrentVirusGenealogy(const ConcurrentVirusGenealogy &) = delete;
+    ConcurrentVirusGenealogy &operator=(const ConcurrentVirusGenealogy &) = delete;
+
+    // Tworzy nową genealogię z wirusem macierzystym o identyfikatorze stem_id.
+    explicit ConcurrentVirusGenealogy(typename Virus::id_type const &stem_id) : genealogy(stem_id) {
+    }
+
+    // Tworzy genealogię z krawędzi {child_id, parent_id}, jak odpowiedni
+    // konstruktor VirusGenealogy.
+    template <typename EdgeRange>
+    ConcurrentVirusGenealogy(typename Virus::id_type const &stem_id, EdgeRange const &edges)
+        : genealogy(stem_id, edges) {
+    }
+
+    typename Virus::id_type get_stem_id() const noexcept {
+        return genealogy.get_stem_id();
+    }
+
+    bool exists(typename Virus::id_type const &id) const {
+        std::shared_lock lock(mutex);
+        return genealogy.exists(id);
+    }
+
+    // Zwraca wskaźnik współdzielący własność wirusa o podanym identyfikatorze.
+    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
+    std::shared_ptr<const Virus> operator[](typename Virus::id_type const &id) const {
+        std::shared_lock lock(mutex);
+        return genealogy.get_virus(id);
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::vector<typename Virus::id_type> get_parents(typename Virus::id_type const &id) const {
+        std::shared_lock lock(mutex);
+        return genealogy.get_parents(id);
+    }
+
+    // Zwraca identyfikatory bezpośrednich następników wirusa, rosnąco.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::vector<typename Virus::id_type> get_children(typename Virus::id_type const &id) const {
+        std::shared_lock lock(mutex);
+        auto children = genealogy.children(id);
+        std::vector<typename Virus::id_type> child_ids;
+        child_ids.reserve(children.size());
+
+        for (Virus const &child : children) {
+            child_ids.push_back(child.get_id());
+        }
+
+        return child_ids;
+    }
+
+    // Wywołuje visitor(const Virus &) dla każdego bezpośredniego następnika
+    // wirusa. Visitor działa pod blokadą współdzieloną, więc nie może
+    // modyfikować tej genealogii.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    template <typename Visitor>
+    void for_each_child(typename Virus::id_type const &id, Visitor &&visitor) const {
+        std::shared_lock lock(mutex);
+        for (Virus const &child : genealogy.children(id)) {
+            visitor(child);
+        }
+    }
+
+    std::size_t children_count(typename Virus::id_type const &id) const {
+        std::shared_lock lock(mutex);
+        return genealogy.children_count(id);
+    }
+
+    std::size_t parents_count(typename Virus::id_type const &id) const {
+        std::shared_lock lock(mutex);
+        return genealogy.parents_count(id);
+    }
+
+    // Zwraca niezmienną migawkę genealogii, którą można przeglądać bez
+    // żadnych blokad, podczas gdy inne wątki dalej ją modyfikują.
+    std::shared_ptr<const genealogy_type> snapshot() const {
+        std::shared_lock lock(mutex);
+        return genealogy.snapshot();
+    }
+
+    // Modyfikacje mają te same gwarancje i zgłaszają te same wyjątki co
+    // odpowiednie metody VirusGenealogy.
+    void create(typename Virus::id_type const &id, typename Virus::id_type const &parent_id) {
+        std::unique_lock lock(mutex);
+        genealogy.create(id, parent_id);
+    }
+
+    void create(typename Virus::id_type const &id,
+                std::vector<typename Virus::id_type> const &parent_ids) {
+        std::unique_lock lock(mutex);
+        genealogy.create(id, parent_ids);
+    }
+
+    void connect(typename Virus::id_type const &child_id,
+                 typename Virus::id_type const &parent_id) {
+        std::unique_lock lock(mutex);
+        genealogy.connect(child_id, parent_id);
+    }
+
+    void remove(typename Virus::id_type const &id) {
+        std::unique_lock lock(mutex);
+        genealogy.remove(id);
+    }
+
+    // Wywołuje f(genealogy_type const &) pod blokadą współdzieloną i zwraca
+    // jej wynik. Pozwala wykonać kilka zapytań na spójnym stanie genealogii,
+    // w tym przeglądanie i zapytania o przodków. Wynik nie powinien
+    // zawierać iteratorów ani referencji do genealogii.
+    template <typename F>
+    decltype(auto) read(F &&f) const {
+        std::shared_lock lock(mutex);
+        return std::forward<F>(f)(std::as_const(genealogy));
+    }
+
+    // Wywołuje f(genealogy_type &) pod blokadą wyłączną i zwraca jej wynik.
+    template <typename F>
+    decltype(auto) write(F &&f) {
+        std::unique_lock lock(mutex);
+        return std::forward<F>(f)(genealogy);
+    }
+
+  private:
+    // Const queries of VirusGenealogy may run concurrently: its lazily built
+    // indexes and memoized counts synchronize internally.
+    mutable std::shared_mutex mutex;
+    genealogy_type genealogy;
+};
+
+#endif // CONCURRENT_VIRUS_GENEALOGY_H
@@ -0,0 +1,291 @@
+#ifndef SHARDED_VIRUS_GENEALOGY_H
+#define SHARDED_VIRUS_GENEALOGY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "virus_genealogy.h"
+
+// Genealogia wirusów podzielona według skrótu identyfikatora na części,
+// z których każda ma własną blokadę, dzięki czemu wiele wątków może
+// jednocześnie tworzyć wirusy i dodawać krawędzie. Operacja dotyka tylko
+// części zawierających podane wirusy; usuwanie, którego kaskada może objąć
+// całą genealogię, wyklucza inne modyfikacje, ale nie odczyty.
+// Wymaga, aby dla typu Virus::id_type była zdefiniowana specjalizacja
+// std::hash. Odczyty zwracają kopie danych i są spójne w obrębie jednego
+// wywołania; kolejne wywołania mogą widzieć zmiany z innych wątków.
+template <typename Virus, typename Storage = HashStorage>
+class ShardedVirusGenealogy {
+  public:
+    ShardedVirusGenealogy(const ShardedVirusGenealogy &) = delete;
+    ShardedVirusGenealogy &operator=(const ShardedVirusGenealogy &) = delete;
+
+    // Tworzy nową genealogię z wirusem macierzystym o identyfikatorze
+    // stem_id, podzieloną na shard_count części (domyślnie tyle, ile
+    // wątków sprzętowych).
+    explicit ShardedVirusGenealogy(typename Virus::id_type const &stem_id,
+                                   std::size_t shard_count = std::thread::hardware_concurrency())
+        : stem_id(stem_id),
+          shard_count(std::max<std::size_t>(shard_count, 1)),
+          shards(std::make_unique<Shard[]>(this->shard_count)) {
+        shard(stem_id).nodes.insert(stem_id, Node(stem_id));
+    }
+
+    typename Virus::id_type get_stem_id() const noexcept {
+        return stem_id;
+    }
+
+    bool exists(typename Virus::id_type const &id) const {
+        Shard const &owner = shard(id);
+        std::shared_lock lock(owner.mutex);
+        return owner.nodes.find(id) != nullptr;
+    }
+
+    // Zwraca wskaźnik współdzielący własność wirusa o podanym identyfikatorze.
+    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
+    std::shared_ptr<const Virus> operator[](typename Virus::id_type const &id) const {
+        Shard const &owner = shard(id);
+        std::shared_lock lock(owner.mutex);
+        return find_node(id).virus;
+    }
+
+    // Zwraca posortowane identyfikatory bezpośrednich poprzedników wirusa.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::vector<typename Virus::id_type> get_parents(typename Virus::id_type const &id) const {
+        Shard const &owner = shard(id);
+        std::shared_lock lock(owner.mutex);
+        return find_node(id).parents;
+    }
+
+    // Zwraca posortowane identyfikatory bezpośrednich następników wirusa.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::vector<typename Virus::id_type> get_children(typename Virus::id_type const &id) const {
+        Shard const &owner = shard(id);
+        std::shared_lock lock(owner.mutex);
+        return find_node(id).children;
+    }
+
+    // Tworzy wirus o identyfikatorze id, powstały z podanych wirusów.
+    // Zgłasza te same wyjątki co VirusGenealogy::create() i w razie
+    // wyjątku nie zmienia genealogii.
+    void create(typename Virus::id_type const &id, typename Virus::id_type const &parent_id) {
+        create(id, std::vector<typename Virus::id_type>{parent_id});
+    }
+
+    void create(typename Virus::id_type const &id,
+                std::vector<typename Virus::id_type> const &parent_ids) {
+        if (parent_ids.empty()) {
+            return;
+        }
+
+        std::vector<typename Virus::id_type> parents = parent_ids;
+        std::sort(parents.begin(), parents.end());
+        parents.erase(std::unique(parents.begin(), parents.end()), parents.end());
+        // The virus is constructed before any lock is taken.
+        Node node(id);
+        node.parents = parents;
+
+        std::vector<std::size_t> touched{shard_of(id)};
+        for (auto const &parent_id : parents) {
+            touched.push_back(shard_of(parent_id));
+        }
+
+        std::shared_lock structure_lock(structure);
+        auto locks = lock_shards(std::move(touched));
+
+        if (find(id) != nullptr) {
+            throw VirusAlreadyCreated();
+        }
+        for (auto const &parent_id : parents) {
+            if (find(parent_id) == nullptr) {
+                throw VirusNotFound();
+            }
+        }
+
+        std::size_t linked = 0;
+        try {
+            for (auto const &parent_id : parents) {
+                insert_sorted(find(parent_id)->children, id);
+                ++linked;
+            }
+            shard(id).nodes.insert(id, std::move(node));
+        } catch (std::exception &e) {
+            for (std::size_t i = 0; i < linked; ++i) {
+                erase_sorted(find(parents[i])->children, id);
+            }
+            throw;
+        }
+    }
+
+    // Dodaje krawędź od wirusa parent_id do wirusa child_id.
+    // Zgłasza wyjątek VirusNotFound, jeśli któryś z podanych wirusów nie istnieje.
+    void connect(typename Virus::id_type const &child_id,
+                 typename Virus::id_type const &parent_id) {
+        std::shared_lock structure_lock(structure);
+        auto locks = lock_shards({shard_of(child_id), shard_of(parent_id)});
+
+        Node *child = find(child_id);
+        Node *parent = find(parent_id);
+        if (child == nullptr || parent == nullptr) {
+            throw VirusNotFound();
+        }
+
+        auto &child_parents = child->parents;
+        auto pos = std::lower_bound(child_parents.begin(), child_parents.end(), parent_id);
+        if (pos != child_parents.end() && *pos == parent_id) {
+            return;
+        }
+        pos = child_parents.insert(pos, parent_id);
+
+        try {
+            insert_sorted(parent->children, child_id);
+        } catch (std::exception &e) {
+            child_parents.erase(pos);
+            throw;
+        }
+    }
+
+    // Usuwa wirus wraz z wirusami, które straciły wszystkich poprzedników,
+    // jak VirusGenealogy::remove(). Na czas usuwania wstrzymuje inne
+    // modyfikacje; odczyty części nieobjętych kaskadą trwają dalej.
+    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
+    // Zgłasza wyjątek TriedToRemoveStemVirus przy próbie usunięcia
+    // wirusa macierzystego.
+    void remove(typename Virus::id_type const &id) {
+        if (id == stem_id) {
+            throw TriedToRemoveStemVirus();
+        }
+
+        std::unique_lock structure_lock(structure);
+        // Every other mutation is excluded and readers only read, so the
+        // cascade can be collected without shard locks.
+        if (find(id) == nullptr) {
+            throw VirusNotFound();
+        }
+
+        auto cascade = Cascade::collect(
+            id, stem_id,
+            [this](typename Virus::id_type const &removed_id) -> auto const & {
+                return find(removed_id)->children;
+            },
+            [this](typename Virus::id_type const &child_id) { return find(child_id)->parents.size(); });
+
+        std::vector<std::size_t> touched;
+        for (auto const &removed_id : cascade.removed) {
+            Node const &node = *find(removed_id);
+            touched.push_back(shard_of(removed_id));
+            for (auto const &parent_id : node.parents) {
+                touched.push_back(shard_of(parent_id));
+            }
+            for (auto const &child_id : node.children) {
+                touched.push_back(shard_of(child_id));
+            }
+        }
+        auto locks = lock_shards(std::move(touched));
+
+        // Nothing below allocates or throws.
+        for (auto const &removed_id : cascade.removed) {
+            Node const &node = *find(removed_id);
+            for (auto const &parent_id : node.parents) {
+                if (!cascade.contains(parent_id)) {
+                    erase_sorted(find(parent_id)->children, removed_id);
+                }
+            }
+            for (auto const &child_id : node.children) {
+                if (!cascade.contains(child_id)) {
+                    erase_sorted(find(child_id)->parents, removed_id);
+                }
+            }
+        }
+        for (auto const &removed_id : cascade.removed) {
+            shard(removed_id).nodes.erase(removed_id);
+        }
+    }
+
+  private:
+    struct Node {
+        std::shared_ptr<Virus> virus;
+        std::vector<typename Virus::id_type> parents;   // Sorted.
+        std::vector<typename Virus::id_type> children;  // Sorted.
+
+        explicit Node(typename Virus::id_type const &id) : virus(std::make_shared<Virus>(id)) {
+        }
+    };
+
+    // Aligned to a cache line, so that the locks of neighbouring shards do
+    // not share one.
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        typename Storage::template table<typename Virus::id_type, Node> nodes{};
+    };
+
+    using Cascade = virus_genealogy_detail::Cascade<
+        typename Virus::id_type, typename Storage::template table<typename Virus::id_type, std::uint32_t>>;
+
+    std::size_t shard_of(typename Virus::id_type const &id) const noexcept {
+        return virus_genealogy_detail::mix_hash(std::hash<typename Virus::id_type>{}(id)) % shard_count;
+    }
+
+    Shard &shard(typename Virus::id_type const &id) noexcept {
+        return shards[shard_of(id)];
+    }
+
+    Shard const &shard(typename Virus::id_type const &id) const noexcept {
+        return shards[shard_of(id)];
+    }
+
+    // Lookups without locking: the caller holds the lock of the node's shard.
+    Node *find(typename Virus::id_type const &id) {
+        return shard(id).nodes.find(id);
+    }
+
+    Node const &find_node(typename Virus::id_type const &id) const {
+        Node const *node = shard(id).nodes.find(id);
+        if (node == nullptr) {
+            throw VirusNotFound();
+        }
+
+        return *node;
+    }
+
+    // Locks each given shard once, in increasing order, so that
+    // concurrent mutations never wait for each other in a cycle.
+    std::vector<std::unique_lock<std::shared_mutex>> lock_shards(std::vector<std::size_t> indices) {
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        locks.reserve(indices.size());
+        for (std::size_t i : indices) {
+            locks.emplace_back(shards[i].mutex);
+        }
+
+        return locks;
+    }
+
+    static void insert_sorted(std::vector<typename Virus::id_type> &ids,
+                              typename Virus::id_type const &id) {
+        ids.insert(std::lower_bound(ids.begin(), ids.end(), id), id);
+    }
+
+    static void erase_sorted(std::vector<typename Virus::id_type> &ids,
+                             typename Virus::id_type const &id) noexcept {
+        ids.erase(std::lower_bound(ids.begin(), ids.end(), id));
+    }
+
+    typename Virus::id_type const stem_id;
+    std::size_t const shard_count;
+    std::unique_ptr<Shard[]> shards;
+    // Held shared by create() and connect(), exclusively by remove().
+    std::shared_mutex structure;
+};
+
+#endif // SHARDED_VIRUS_GENEALOGY_H
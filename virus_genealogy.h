@@ -1,13 +1,36 @@
 #ifndef VIRUS_GENEALOGY_H
 #define VIRUS_GENEALOGY_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <ios>
+#include <istream>
+#include <limits>
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <ranges>
 #include <set>
+#include <stdexcept>
+#include <streambuf>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "work_stealing_pool.h"
+
 class VirusNotFound : public std::exception {
   public:
     const char *what() const noexcept override {
@@ -26,271 +49,3496 @@ class TriedToRemoveStemVirus : public std::exception {
         return "TriedToRemoveStemVirus";
     }
 };
+class TriedToCreateCycle : public std::exception {
+  public:
+    const char *what() const noexcept override {
+        return "TriedToCreateCycle";
+    }
+};
+class InvalidGenealogyFile : public std::exception {
+  public:
+    const char *what() const noexcept override {
+        return "InvalidGenealogyFile";
+    }
+};
 
-template <typename Virus>
-class VirusGenealogy {
+// Kolejność odwiedzania wirusów przy przeglądaniu genealogii.
+enum class TraversalOrder {
+    breadth_first,
+    depth_first,
+    // Każdy wirus po wszystkich swoich przeglądanych poprzednikach.
+    topological,
+};
+
+// Sposób mierzenia głębokości wirusa w genealogii.
+enum class DepthKind {
+    // Długość najkrótszej ścieżki od wirusa macierzystego.
+    shortest,
+    // Długość najdłuższej ścieżki od wirusa macierzystego.
+    longest,
+};
+
+namespace virus_genealogy_detail {
+
+// Tag identifying which copy of a copy-on-write structure may write to
+// a page in place. Copying gives both sides fresh tags, so that neither
+// writes to the pages they now share; moving hands the tag over.
+class PageOwner {
   public:
-    using virus_set_iterator = typename std::set<std::shared_ptr<Virus>>::iterator;
+    PageOwner() noexcept : tag(next()) {
+    }
+
+    PageOwner(PageOwner const &other) noexcept : tag(next()) {
+        other.tag.store(next(), std::memory_order_relaxed);
+    }
+
+    PageOwner(PageOwner &&other) noexcept : tag(other.tag.load(std::memory_order_relaxed)) {
+        other.tag.store(next(), std::memory_order_relaxed);
+    }
 
-    struct Iterator {
-        using iterator_category = std::bidirectional_iterator_tag;
-        using difference_type = std::ptrdiff_t;
-        using value_type = Virus;
-        using pointer = std::shared_ptr<Virus>;
-        using reference = const Virus &;
-        explicit Iterator(virus_set_iterator ptr) : m_ptr(ptr) {
+    PageOwner &operator=(PageOwner const &other) noexcept {
+        if (this != &other) {
+            tag.store(next(), std::memory_order_relaxed);
+            other.tag.store(next(), std::memory_order_relaxed);
         }
-        Iterator() = default;
+        return *this;
+    }
 
-        reference operator*() const {
-            return **m_ptr;
+    PageOwner &operator=(PageOwner &&other) noexcept {
+        if (this != &other) {
+            tag.store(other.tag.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            other.tag.store(next(), std::memory_order_relaxed);
         }
+        return *this;
+    }
+
+    std::uint64_t get() const noexcept {
+        return tag.load(std::memory_order_relaxed);
+    }
+
+  private:
+    static std::uint64_t next() noexcept {
+        static std::atomic<std::uint64_t> counter{1};
+        return counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Mutable: a copy retags its source, which readers may hold as const.
+    // They never read the tag, only the pages.
+    mutable std::atomic<std::uint64_t> tag;
+};
+
+// Array split into fixed-size pages that copies share, so that copying
+// costs one pointer per page. A write through mut() first copies the page,
+// unless this array owns it. Code that must not allocate calls own() on
+// the elements it is going to write beforehand.
+template <typename T>
+class PagedArray {
+  public:
+    static constexpr std::size_t page_size = 4096;
 
-        pointer operator->() {
-            return *m_ptr;
+    PagedArray() = default;
+
+    PagedArray(std::size_t size, T const &value) {
+        resize(size, value);
+    }
+
+    PagedArray(PagedArray const &) = default;
+    PagedArray &operator=(PagedArray const &) = default;
+
+    PagedArray(PagedArray &&other) noexcept
+        : pages(std::move(other.pages)),
+          length(std::exchange(other.length, 0)),
+          owner(std::move(other.owner)) {
+    }
+
+    PagedArray &operator=(PagedArray &&other) noexcept {
+        pages = std::move(other.pages);
+        other.pages.clear();
+        length = std::exchange(other.length, 0);
+        owner = std::move(other.owner);
+        return *this;
+    }
+
+    T const &operator[](std::size_t i) const noexcept {
+        return pages[i / page_size]->items[i % page_size];
+    }
+
+    T &mut(std::size_t i) {
+        return own_page(i / page_size).items[i % page_size];
+    }
+
+    void own(std::size_t i) {
+        own_page(i / page_size);
+    }
+
+    std::size_t size() const noexcept {
+        return length;
+    }
+
+    bool empty() const noexcept {
+        return length == 0;
+    }
+
+    template <typename... Args>
+    T &emplace_back(Args &&...args) {
+        T *item;
+        if (length % page_size == 0) {
+            auto page = std::make_shared<Page>(owner.get());
+            item = &page->items.emplace_back(std::forward<Args>(args)...);
+            pages.push_back(std::move(page));
+        } else {
+            item = &own_page(pages.size() - 1).items.emplace_back(std::forward<Args>(args)...);
         }
+        ++length;
+        return *item;
+    }
 
-        // Prefix increment
-        Iterator &operator++() {
-            m_ptr++;
-            return *this;
+    // Only grows the array.
+    void resize(std::size_t size, T const &value) {
+        reserve(size);
+        while (length < size) {
+            if (length % page_size == 0) {
+                pages.push_back(std::make_shared<Page>(owner.get()));
+            }
+            auto &items = own_page(pages.size() - 1).items;
+            std::size_t added = std::min(size - length, page_size - items.size());
+            items.resize(items.size() + added, value);
+            length += added;
         }
+    }
 
-        // Postfix increment
-        Iterator operator++(int) {
-            Iterator tmp = *this;
-            ++(*this);
-            return tmp;
+    void reserve(std::size_t size) {
+        std::size_t needed = (size + page_size - 1) / page_size;
+        if (needed > pages.capacity()) {
+            pages.reserve(std::max(needed, pages.capacity() * 2));
         }
+    }
+
+  private:
+    struct Page {
+        std::uint64_t owner;
+        std::vector<T> items;
 
-        // Prefix decrement
-        Iterator &operator--() {
-            m_ptr--;
-            return *this;
+        explicit Page(std::uint64_t owner) noexcept : owner(owner) {
         }
+    };
 
-        // Postfix decrement
-        Iterator operator--(int) {
-            Iterator tmp = *this;
-            --(*this);
-            return tmp;
+    Page &own_page(std::size_t index) {
+        if (pages[index]->owner != owner.get()) {
+            auto copy = std::make_shared<Page>(*pages[index]);
+            copy->owner = owner.get();
+            pages[index] = std::move(copy);
         }
+        return *pages[index];
+    }
 
-        friend bool operator==(const Iterator &a, const Iterator &b) {
-            return a.m_ptr == b.m_ptr;
-        };
-        friend bool operator!=(const Iterator &a, const Iterator &b) {
-            return a.m_ptr != b.m_ptr;
-        };
+    std::vector<std::shared_ptr<Page>> pages;
+    std::size_t length = 0;
+    PageOwner owner;
+};
 
-      private:
-        virus_set_iterator m_ptr;
-    };
-    using children_iterator = Iterator;
+// Table ordered by key, split into std::map pages of contiguous key ranges
+// that copies share until they write to them (see PagedArray).
+template <typename Key, typename Value>
+class OrderedTable {
+  public:
+    OrderedTable() = default;
+    OrderedTable(OrderedTable const &) = default;
+    OrderedTable &operator=(OrderedTable const &) = default;
 
-    VirusGenealogy(const VirusGenealogy<Virus> &) = delete;
-    VirusGenealogy &operator=(const VirusGenealogy<Virus> &) = delete;
+    OrderedTable(OrderedTable &&other) noexcept
+        : bounds(std::move(other.bounds)),
+          pages(std::move(other.pages)),
+          count(std::exchange(other.count, 0)),
+          owner(std::move(other.owner)) {
+    }
 
-    // Tworzy nową genealogię.
-    // Tworzy także węzeł wirusa macierzystego o identyfikatorze stem_id.
-    explicit VirusGenealogy(typename Virus::id_type const &stem_id)
-        : stem_id(stem_id), graph{{stem_id, Node(stem_id)}} {
+    OrderedTable &operator=(OrderedTable &&other) noexcept {
+        bounds = std::move(other.bounds);
+        pages = std::move(other.pages);
+        other.bounds.clear();
+        other.pages.clear();
+        count = std::exchange(other.count, 0);
+        owner = std::move(other.owner);
+        return *this;
     }
 
-    // Zwraca identyfikator wirusa macierzystego.
-    typename Virus::id_type get_stem_id() const noexcept {
-        return stem_id;
+    Value *find(Key const &key) {
+        if (std::as_const(*this).find(key) == nullptr) {
+            return nullptr;
+        }
+        return &own_page(page_of(key)).map.find(key)->second;
     }
 
-    // Zwraca iterator pozwalający przeglądać listę identyfikatorów
-    // bezpośrednich następników wirusa o podanym identyfikatorze.
-    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
-    // Iterator musi spełniać koncept bidirectional_iterator oraz
-    // typeid(*v.get_children_begin()) == typeid(const Virus &).
-    VirusGenealogy<Virus>::children_iterator
-    get_children_begin(typename Virus::id_type const &id) const {
-        auto it = graph.find(id);
-        if (it == graph.end()) {
-            throw VirusNotFound();
+    Value const *find(Key const &key) const noexcept {
+        if (pages.empty()) {
+            return nullptr;
+        }
+        auto const &map = pages[page_of(key)]->map;
+        auto it = map.find(key);
+        return it == map.end() ? nullptr : &it->second;
+    }
+
+    // Precondition: key is not present.
+    Value &insert(Key const &key, Value value) {
+        if (pages.empty()) {
+            pages.push_back(std::make_shared<Page>(owner.get()));
+        }
+        std::size_t index = page_of(key);
+        if (pages[index]->map.size() >= 2 * page_size) {
+            split(index);
+            index = page_of(key);
         }
+        // Amortised constant when keys arrive in increasing order, as in bulk loads.
+        auto &map = own_page(index).map;
+        Value &inserted = map.emplace_hint(map.end(), key, std::move(value))->second;
+        ++count;
+        return inserted;
+    }
 
-        return Iterator(it->second.children_virus_ptrs.begin());
+    // Does not allocate if own(key) was called before.
+    void erase(Key const &key) noexcept {
+        if (find(key) == nullptr) {
+            return;
+        }
+        std::size_t index = page_of(key);
+        auto &map = pages[index]->map;
+        map.erase(key);
+        --count;
+        if (map.empty() && pages.size() > 1) {
+            pages.erase(pages.begin() + static_cast<std::ptrdiff_t>(index));
+            bounds.erase(bounds.begin() + static_cast<std::ptrdiff_t>(index == 0 ? 0 : index - 1));
+        }
     }
 
-    // Iterator wskazujący na element za końcem wyżej wspomnianej listy.
-    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
-    VirusGenealogy<Virus>::children_iterator
-    get_children_end(typename Virus::id_type const &id) const {
-        auto it = graph.find(id);
-        if (it == graph.end()) {
-            throw VirusNotFound();
+    void own(Key const &key) {
+        if (!pages.empty()) {
+            own_page(page_of(key));
         }
+    }
 
-        return Iterator(it->second.children_virus_ptrs.end());
+    // Tree nodes are allocated one by one; there is nothing to reserve.
+    void reserve(std::size_t) noexcept {
     }
 
-    // Zwraca listę identyfikatorów bezpośrednich poprzedników wirusa
-    // o podanym identyfikatorze.
-    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
-    std::vector<typename Virus::id_type> get_parents(typename Virus::id_type const &id) const {
-        auto it = graph.find(id);
-        if (it == graph.end()) {
-            throw VirusNotFound();
+    std::size_t size() const noexcept {
+        return count;
+    }
+
+  private:
+    static constexpr std::size_t page_size = 1024;
+
+    struct Page {
+        std::uint64_t owner;
+        std::map<Key, Value> map;
+
+        explicit Page(std::uint64_t owner) noexcept : owner(owner) {
         }
+    };
 
-        return std::vector<typename Virus::id_type>(it->second.parent_ids.begin(),
-                                                    it->second.parent_ids.end());
+    // Page i holds the keys in [bounds[i - 1], bounds[i]).
+    std::size_t page_of(Key const &key) const noexcept {
+        return static_cast<std::size_t>(std::upper_bound(bounds.begin(), bounds.end(), key) - bounds.begin());
     }
 
-    // Sprawdza, czy wirus o podanym identyfikatorze istnieje.
-    bool exists(typename Virus::id_type const &id) const noexcept {
-        return graph.find(id) != graph.end();
+    Page &own_page(std::size_t index) {
+        if (pages[index]->owner != owner.get()) {
+            auto copy = std::make_shared<Page>(*pages[index]);
+            copy->owner = owner.get();
+            pages[index] = std::move(copy);
+        }
+        return *pages[index];
     }
 
-    // Zwraca referencję do obiektu reprezentującego wirus o podanym
-    // identyfikatorze.
-    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
-    const Virus &operator[](typename Virus::id_type const &id) const {
-        auto it = graph.find(id);
-        if (it == graph.end()) {
-            throw VirusNotFound();
+    // Moves the upper half of a page into a new one. Tree nodes are moved,
+    // not reallocated.
+    void split(std::size_t index) {
+        auto upper = std::make_shared<Page>(owner.get());
+        auto &map = own_page(index).map;
+        auto middle = std::next(map.begin(), static_cast<std::ptrdiff_t>(map.size() / 2));
+        bounds.insert(bounds.begin() + static_cast<std::ptrdiff_t>(index), middle->first);
+        try {
+            pages.insert(pages.begin() + static_cast<std::ptrdiff_t>(index) + 1, upper);
+        } catch (std::exception &e) {
+            bounds.erase(bounds.begin() + static_cast<std::ptrdiff_t>(index));
+            throw;
         }
+        while (middle != map.end()) {
+            upper->map.insert(upper->map.end(), map.extract(middle++));
+        }
+    }
+
+    std::vector<Key> bounds;
+    std::vector<std::shared_ptr<Page>> pages;
+    std::size_t count = 0;
+    PageOwner owner;
+};
 
-        return *(it->second.virus);
+// std::hash is the identity for integers; spread the bits before masking.
+inline std::size_t mix_hash(std::size_t hash) noexcept {
+    std::uint64_t h = static_cast<std::uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+    return static_cast<std::size_t>(h ^ (h >> 32));
+}
+
+// Open-addressing hash table with linear probing. Control bytes and slots
+// live in two paged arrays, so a probe sequence touches neighbouring
+// memory only and copies share unchanged pages. Erased slots become
+// tombstones until the next rehash.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class HashTable {
+    static_assert(std::is_invocable_r_v<std::size_t, Hash const &, Key const &>,
+                  "HashStorage requires a hashable Virus::id_type");
+
+  public:
+    Value *find(Key const &key) {
+        std::size_t pos = locate(key);
+        return pos == npos ? nullptr : &slots.mut(pos)->second;
     }
 
-    // Tworzy węzeł reprezentujący nowy wirus o identyfikatorze id
-    // powstały z wirusów o podanych identyfikatorach parent_ids.
-    // Zgłasza wyjątek VirusAlreadyCreated, jeśli wirus o identyfikatorze
-    // id już istnieje.
-    // Zgłasza wyjątek VirusNotFound, jeśli któryś z wyspecyfikowanych
-    // poprzedników nie istnieje.
-    void create(typename Virus::id_type const &id,
-                std::vector<typename Virus::id_type> const &parent_ids) {
-        if (parent_ids.empty()) {
-            return;
+    Value const *find(Key const &key) const noexcept {
+        std::size_t pos = locate(key);
+        return pos == npos ? nullptr : &slots[pos]->second;
+    }
+
+    // Precondition: key is not present.
+    Value &insert(Key const &key, Value value) {
+        reserve(count + 1);
+
+        std::size_t hash = mix_hash(hasher(key));
+        std::size_t pos = (hash >> 7) & (ctrl.size() - 1);
+        while (ctrl[pos] >= full) {
+            pos = (pos + 1) & (ctrl.size() - 1);
         }
-        auto it_new_node = graph.find(id);
-        if (it_new_node != graph.end()) {
-            throw VirusAlreadyCreated();
+
+        ctrl.own(pos);
+        auto &slot = slots.mut(pos);
+        slot.emplace(key, std::move(value));
+        if (ctrl[pos] == empty) {
+            ++used;
+        }
+        ctrl.mut(pos) = static_cast<std::uint8_t>(full | (hash & 0x7f));
+        ++count;
+        return slot->second;
+    }
+
+    // Does not allocate if own(key) was called before.
+    void erase(Key const &key) noexcept {
+        std::size_t pos = locate(key);
+        if (pos == npos) {
+            return;
         }
+        ctrl.mut(pos) = deleted;
+        slots.mut(pos).reset();
+        --count;
+    }
 
-        std::vector<parent_id_iterator> parents_its;
+    void own(Key const &key) {
+        std::size_t pos = locate(key);
+        if (pos != npos) {
+            ctrl.own(pos);
+            slots.own(pos);
+        }
+    }
 
-        for (auto parent_id : parent_ids) {
-            auto temporary = graph.find(parent_id);
-            if (temporary == graph.end()) {
-                throw VirusNotFound();
-            }
-            parents_its.push_back(temporary);
+    // Guarantees that inserting up to n values in total does not rehash.
+    void reserve(std::size_t n) {
+        if (used - count + n <= max_load(ctrl.size())) {
+            return;
         }
+        std::size_t capacity = min_capacity;
+        while (max_load(capacity) < n) {
+            capacity *= 2;
+        }
+        rehash(capacity);
+    }
+
+    std::size_t size() const noexcept {
+        return count;
+    }
 
-        auto new_node = Node(id);
-        std::vector<virus_set_iterator> edges_to_parents;
+  private:
+    using Entry = std::pair<Key, Value>;
+
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+    static constexpr std::size_t min_capacity = 16;
+    static constexpr std::uint8_t empty = 0;
+    static constexpr std::uint8_t deleted = 1;
+    static constexpr std::uint8_t full = 0x80;
+
+    static std::size_t max_load(std::size_t capacity) noexcept {
+        return capacity / 8 * 7;
+    }
 
-        for (auto parent_id : parent_ids) {
-            new_node.parent_ids.insert(parent_id);
+    std::size_t locate(Key const &key) const noexcept {
+        if (count == 0) {
+            return npos;
         }
+        std::size_t hash = mix_hash(hasher(key));
+        auto tag = static_cast<std::uint8_t>(full | (hash & 0x7f));
+        std::size_t pos = (hash >> 7) & (ctrl.size() - 1);
+        while (ctrl[pos] != empty) {
+            if (ctrl[pos] == tag && slots[pos]->first == key) {
+                return pos;
+            }
+            pos = (pos + 1) & (ctrl.size() - 1);
+        }
+        return npos;
+    }
 
-        try {
-            for (auto parent_it : parents_its) {
-                auto [it, added] = parent_it->second.children_virus_ptrs.insert(new_node.virus);
-                edges_to_parents.push_back(it);
+    void rehash(std::size_t capacity) {
+        PagedArray<std::uint8_t> new_ctrl(capacity, empty);
+        PagedArray<std::optional<Entry>> new_slots(capacity, std::nullopt);
+
+        for (std::size_t i = 0; i < ctrl.size(); ++i) {
+            if (ctrl[i] < full) {
+                continue;
             }
-            graph.insert({id, new_node});
-        } catch (std::exception &e) {
-            for (size_t i = 0; i < edges_to_parents.size(); ++i) {
-                parents_its[i]->second.children_virus_ptrs.erase(edges_to_parents[i]);
+            std::size_t pos = (mix_hash(hasher(slots[i]->first)) >> 7) & (capacity - 1);
+            while (new_ctrl[pos] != empty) {
+                pos = (pos + 1) & (capacity - 1);
             }
-            throw;
+            // The old slots may be shared with a copy, so they are copied, not moved.
+            new_slots.mut(pos).emplace(*slots[i]);
+            new_ctrl.mut(pos) = ctrl[i];
         }
+
+        ctrl = std::move(new_ctrl);
+        slots = std::move(new_slots);
+        used = count;
     }
 
-    // Tworzy węzeł reprezentujący nowy wirus o identyfikatorze id
-    // powstały z wirusa o podanym identyfikatorze parent_id.
-    // Zgłasza wyjątek VirusAlreadyCreated, jeśli wirus o identyfikatorze
-    // id już istnieje.
-    // Zgłasza wyjątek VirusNotFound, jeśli któryś z wyspecyfikowanych
-    // poprzedników nie istnieje.
-    void create(typename Virus::id_type const &id, typename Virus::id_type const &parent_id) {
-        create(id, std::vector<typename Virus::id_type>(1, parent_id));
+    PagedArray<std::uint8_t> ctrl;
+    PagedArray<std::optional<Entry>> slots;
+    std::size_t count = 0;
+    std::size_t used = 0;
+    [[no_unique_address]] Hash hasher{};
+};
+
+// Table for integral keys allocated roughly sequentially: the key itself is
+// the slot index, so a lookup is a single bounds check and array access.
+// A removed slot is simply emptied and gets reused when its key is created
+// again, which makes the slot array its own free-list. Slots are paged as
+// in PagedArray.
+template <typename Key, typename Value>
+class DenseTable {
+    static_assert(std::is_integral_v<Key>, "DenseStorage requires an integral Virus::id_type");
+
+  public:
+    Value *find(Key const &key) {
+        return contains(key) ? &*slots.mut(static_cast<std::size_t>(key)) : nullptr;
     }
 
-    // Dodaje nową krawędź w grafie genealogii.
-    // Zgłasza wyjątek VirusNotFound, jeśli któryś z podanych wirusów nie istnieje.
-    void connect(typename Virus::id_type const &child_id,
-                 typename Virus::id_type const &parent_id) {
-        auto child_it = graph.find(child_id);
-        auto parent_it = graph.find(parent_id);
-        if (child_it == graph.end() || parent_it == graph.end()) {
-            throw VirusNotFound();
+    Value const *find(Key const &key) const noexcept {
+        return contains(key) ? &*slots[static_cast<std::size_t>(key)] : nullptr;
+    }
+
+    // Precondition: key is not present.
+    Value &insert(Key const &key, Value value) {
+        grow_for(key);
+        Value &inserted = slots.mut(static_cast<std::size_t>(key)).emplace(std::move(value));
+        ++count;
+        return inserted;
+    }
+
+    // Does not allocate if own(key) was called before.
+    void erase(Key const &key) noexcept {
+        if (contains(key)) {
+            slots.mut(static_cast<std::size_t>(key)).reset();
+            --count;
         }
+    }
 
-        if (!child_it->second.parent_ids.insert(parent_id).second) {
-            return;
+    void own(Key const &key) {
+        if (contains(key)) {
+            slots.own(static_cast<std::size_t>(key));
         }
+    }
 
-        try {
-            parent_it->second.children_virus_ptrs.insert(child_it->second.virus);
-        } catch (std::exception &e) {
-            child_it->second.parent_ids.erase(parent_id);
-            throw;
+    // Slots are addressed by key, so they cannot be reserved by count.
+    void reserve(std::size_t) noexcept {
+    }
+
+    std::size_t size() const noexcept {
+        return count;
+    }
+
+  private:
+    void grow_for(Key const &key) {
+        if constexpr (std::is_signed_v<Key>) {
+            if (key < 0) {
+                throw std::out_of_range("DenseStorage requires non-negative ids");
+            }
+        }
+        // The largest ids would wrap index + 1 around to zero.
+        if (!std::in_range<std::size_t>(key) || static_cast<std::size_t>(key) >= max_slots) {
+            throw std::length_error("DenseStorage id too large");
+        }
+        auto index = static_cast<std::size_t>(key);
+        if (index >= slots.size()) {
+            slots.resize(std::max(index + 1, std::min(slots.size() * 2, max_slots)), std::nullopt);
         }
     }
 
-    // Usuwa wirus o podanym identyfikatorze.
-    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
-    // Zgłasza wyjątek TriedToRemoveStemVirus przy próbie usunięcia
-    // wirusa macierzystego.
-    void remove(typename Virus::id_type const &id) {
-        if (id == stem_id) {
-            throw TriedToRemoveStemVirus();
+    bool contains(Key const &key) const noexcept {
+        if constexpr (std::is_signed_v<Key>) {
+            if (key < 0) {
+                return false;
+            }
         }
-        auto it = graph.find(id);
-        if (it == graph.end()) {
-            throw VirusNotFound();
+        if (!std::in_range<std::size_t>(key)) {
+            return false;
         }
+        auto index = static_cast<std::size_t>(key);
+        return index < slots.size() && slots[index].has_value();
+    }
 
-        std::vector<parent_id_iterator> parent_its;
+    static constexpr std::size_t max_slots =
+        static_cast<std::size_t>(std::numeric_limits<std::ptrdiff_t>::max()) / sizeof(std::optional<Value>);
 
-        for (auto parent_id : it->second.parent_ids) {
-            parent_its.push_back(graph.find(parent_id));
-        }
+    PagedArray<std::optional<Value>> slots;
+    std::size_t count = 0;
+};
+
+// The nodes deleted by removing one node: the node itself and,
+// transitively, every node whose parents are all deleted. Per-node counters
+// of deleted parents are kept in a Counts table only for the affected part
+// of the graph.
+template <typename Key, typename Counts>
+class Cascade {
+  public:
+    std::vector<Key> removed;
 
-        for (auto child : it->second.children_virus_ptrs) {
-            auto child_node = graph.find(child->get_id());
-            child_node->second.parent_ids.erase(id);
-            if (child_node->second.parent_ids.empty()) {
-                try {
-                    remove(child_node->first);
-                } catch (std::exception &e) {
-                    child_node->second.parent_ids.insert(id);
-                    throw;
+    bool contains(Key const &key) const noexcept {
+        std::uint32_t const *count = removed_parents.find(key);
+        return count != nullptr && *count == removed_mark;
+    }
+
+    // Walks the cascade from start with an explicit worklist instead of
+    // recursion, so deep mutation chains do not grow the call stack.
+    // children(key) returns the children of a node and parent_count(key)
+    // the number of its parents; neither is modified.
+    // Throws TriedToRemoveStemVirus if the cascade reaches the stem.
+    template <typename Children, typename ParentCount>
+    static Cascade collect(Key const &start, Key const &stem, Children &&children,
+                           ParentCount &&parent_count) {
+        Cascade cascade;
+        cascade.removed.push_back(start);
+        cascade.removed_parents.insert(start, removed_mark);
+
+        for (std::size_t i = 0; i < cascade.removed.size(); ++i) {
+            for (Key const &child : children(cascade.removed[i])) {
+                std::uint32_t *count = cascade.removed_parents.find(child);
+                if (count == nullptr) {
+                    count = &cascade.removed_parents.insert(child, 0);
+                } else if (*count == removed_mark) {
+                    continue;
+                }
+
+                if (++*count == parent_count(child)) {
+                    if (child == stem) {
+                        throw TriedToRemoveStemVirus();
+                    }
+                    *count = removed_mark;
+                    cascade.removed.push_back(child);
                 }
             }
         }
 
-        for (auto parent_it : parent_its) {
-            parent_it->second.children_virus_ptrs.erase(it->second.virus);
-        }
-        graph.erase(id);
+        return cascade;
     }
 
   private:
-    class Node {
-      public:
-        std::shared_ptr<Virus> virus;
-        std::set<typename Virus::id_type> parent_ids;
-        std::set<std::shared_ptr<Virus>> children_virus_ptrs;
+    static constexpr std::uint32_t removed_mark = std::numeric_limits<std::uint32_t>::max();
 
-        explicit Node(typename Virus::id_type const &virus_id) {
-            virus = std::make_shared<Virus>(virus_id);
-        }
-    };
+    Counts removed_parents{};
+};
 
-    typename Virus::id_type const stem_id;
-    std::map<typename Virus::id_type, Node> graph{};
-    using parent_id_iterator = typename std::map<typename Virus::id_type, Node>::iterator;
+// Exposes the virus a node index stands for. Source provides
+// virus_of(index), as VirusGenealogy's state and FrozenVirusGenealogy do.
+template <typename Virus>
+struct VirusProjection {
+    using value_type = Virus;
+    using pointer = std::shared_ptr<Virus>;
+
+    template <typename Source>
+    static const Virus &get(Source const &source, std::uint32_t node) noexcept {
+        return *source.virus_of(node);
+    }
+
+    template <typename Source>
+    static pointer address(Source const &source, std::uint32_t node) noexcept {
+        return source.virus_of(node);
+    }
+};
+
+// Exposes the id a node index stands for, through Source::id_of(index).
+template <typename Id>
+struct IdProjection {
+    using value_type = Id;
+    using pointer = const value_type *;
+
+    template <typename Source>
+    static const value_type &get(Source const &source, std::uint32_t node) noexcept {
+        return source.id_of(node);
+    }
+
+    template <typename Source>
+    static pointer address(Source const &source, std::uint32_t node) noexcept {
+        return &source.id_of(node);
+    }
+};
+
+// Random-access iterator over a contiguous array of 32-bit node indices,
+// exposing each node of Source through Projection.
+template <typename Source, typename Projection>
+struct IndexIterator {
+    using iterator_category = std::random_access_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = typename Projection::value_type;
+    using pointer = typename Projection::pointer;
+    using reference = const value_type &;
+    IndexIterator(std::uint32_t const *ptr, Source const &source) : m_ptr(ptr), m_source(&source) {
+    }
+    IndexIterator() = default;
+
+    reference operator*() const {
+        return Projection::get(*m_source, *m_ptr);
+    }
+
+    pointer operator->() const {
+        return Projection::address(*m_source, *m_ptr);
+    }
+
+    reference operator[](difference_type n) const {
+        return *(*this + n);
+    }
+
+    // Prefix increment
+    IndexIterator &operator++() {
+        ++m_ptr;
+        return *this;
+    }
+
+    // Postfix increment
+    IndexIterator operator++(int) {
+        IndexIterator tmp = *this;
+        ++(*this);
+        return tmp;
+    }
+
+    // Prefix decrement
+    IndexIterator &operator--() {
+        --m_ptr;
+        return *this;
+    }
+
+    // Postfix decrement
+    IndexIterator operator--(int) {
+        IndexIterator tmp = *this;
+        --(*this);
+        return tmp;
+    }
+
+    IndexIterator &operator+=(difference_type n) {
+        m_ptr += n;
+        return *this;
+    }
+
+    IndexIterator &operator-=(difference_type n) {
+        m_ptr -= n;
+        return *this;
+    }
+
+    friend IndexIterator operator+(IndexIterator it, difference_type n) {
+        return it += n;
+    }
+
+    friend IndexIterator operator+(difference_type n, IndexIterator it) {
+        return it += n;
+    }
+
+    friend IndexIterator operator-(IndexIterator it, difference_type n) {
+        return it -= n;
+    }
+
+    friend difference_type operator-(const IndexIterator &a, const IndexIterator &b) {
+        return a.m_ptr - b.m_ptr;
+    }
+
+    friend bool operator==(const IndexIterator &a, const IndexIterator &b) {
+        return a.m_ptr == b.m_ptr;
+    }
+
+    friend auto operator<=>(const IndexIterator &a, const IndexIterator &b) {
+        return a.m_ptr <=> b.m_ptr;
+    }
+
+  private:
+    std::uint32_t const *m_ptr = nullptr;
+    Source const *m_source = nullptr;
+};
+
+// Bitmap of visited handles. Remembers which words it has touched, so that
+// clearing costs as much as the traversal that filled it, not the size of
+// the whole genealogy.
+class VisitedSet {
+  public:
+    // Returns false if the handle was already present.
+    bool insert(std::uint32_t handle) {
+        std::size_t word = handle >> 6;
+        if (word >= words.size()) {
+            words.resize(std::max(word + 1, 2 * words.size()), 0);
+        }
+        std::uint64_t bit = std::uint64_t{1} << (handle & 63);
+        if ((words[word] & bit) != 0) {
+            return false;
+        }
+        if (words[word] == 0) {
+            touched.push_back(static_cast<std::uint32_t>(word));
+        }
+        words[word] |= bit;
+        return true;
+    }
+
+    bool contains(std::uint32_t handle) const noexcept {
+        std::size_t word = handle >> 6;
+        return word < words.size() && (words[word] & (std::uint64_t{1} << (handle & 63))) != 0;
+    }
+
+    void clear() noexcept {
+        for (std::uint32_t word : touched) {
+            words[word] = 0;
+        }
+        touched.clear();
+    }
+
+  private:
+    std::vector<std::uint64_t> words;
+    std::vector<std::uint32_t> touched;
+};
+
+// Working memory of a single graph traversal.
+struct TraversalScratch {
+    VisitedSet visited;
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> frontier;  // {handle, depth}
+};
+
+// Lends one of the calling thread's cached TraversalScratch objects for the
+// lifetime of the lease, so consecutive traversals reuse their memory
+// without any locking. A few leases may be nested (e.g. a reachability
+// check inside a traversal); deeper ones get a fresh scratch.
+class ScratchLease {
+  public:
+    ScratchLease() noexcept {
+        Cache &cached = cache();
+        if (cached.size > 0) {
+            scratch = std::move(cached.slots[--cached.size]);
+        }
+    }
+
+    ScratchLease(const ScratchLease &) = delete;
+    ScratchLease &operator=(const ScratchLease &) = delete;
+
+    ~ScratchLease() {
+        Cache &cached = cache();
+        if (cached.size < cached.slots.size()) {
+            scratch.visited.clear();
+            scratch.frontier.clear();
+            cached.slots[cached.size++] = std::move(scratch);
+        }
+    }
+
+    TraversalScratch &operator*() noexcept {
+        return scratch;
+    }
+
+  private:
+    struct Cache {
+        std::array<TraversalScratch, 4> slots;
+        std::size_t size = 0;
+    };
+
+    static Cache &cache() noexcept {
+        static thread_local Cache cached;
+        return cached;
+    }
+
+    TraversalScratch scratch;
+};
+
+// Data derived from the genealogy and rebuilt on first use after the
+// genealogy changes. Queries may run concurrently with each other; only the
+// first one after invalidation pays for the rebuild. Invalidation happens in
+// mutations, which must not run concurrently with queries anyway.
+template <typename T>
+class LazyIndex {
+  public:
+    template <typename Build>
+    T const &get(Build &&build) const {
+        if (!valid.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!valid.load(std::memory_order_relaxed)) {
+                value = build();
+                valid.store(true, std::memory_order_release);
+            }
+        }
+        return value;
+    }
+
+    void invalidate() noexcept {
+        valid.store(false, std::memory_order_relaxed);
+    }
+
+    // Lets the owner keep an already built value up to date.
+    T *built() noexcept {
+        return valid.load(std::memory_order_relaxed) ? &value : nullptr;
+    }
+
+  private:
+    mutable std::mutex mutex;
+    mutable std::atomic<bool> valid{false};
+    mutable T value{};
+};
+
+constexpr std::array<std::uint32_t, 256> make_crc32_table() noexcept {
+    std::array<std::uint32_t, 256> table{};
+    for (std::uint32_t i = 0; i < 256; ++i) {
+        std::uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) != 0 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}
+
+inline constexpr std::array<std::uint32_t, 256> crc32_table = make_crc32_table();
+
+// CRC-32 (IEEE 802.3), updated incrementally.
+class Crc32 {
+  public:
+    void update(char const *data, std::size_t size) noexcept {
+        for (std::size_t i = 0; i < size; ++i) {
+            crc = crc32_table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+    }
+
+    std::uint32_t value() const noexcept {
+        return ~crc;
+    }
+
+  private:
+    std::uint32_t crc = 0xFFFFFFFFu;
+};
+
+// Unbuffered stream buffer that forwards to another one and checksums every
+// byte written or consumed through it, so that the serializer can use plain
+// stream operations.
+class ChecksumStreamBuf : public std::streambuf {
+  public:
+    explicit ChecksumStreamBuf(std::streambuf *target) noexcept : target(target) {
+    }
+
+    std::uint32_t checksum() const noexcept {
+        return crc.value();
+    }
+
+  protected:
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        char ch = traits_type::to_char_type(c);
+        if (traits_type::eq_int_type(target->sputc(ch), traits_type::eof())) {
+            return traits_type::eof();
+        }
+        crc.update(&ch, 1);
+        return c;
+    }
+
+    std::streamsize xsputn(char const *s, std::streamsize n) override {
+        std::streamsize written = target->sputn(s, n);
+        crc.update(s, static_cast<std::size_t>(written));
+        return written;
+    }
+
+    int_type underflow() override {
+        return target->sgetc();
+    }
+
+    int_type uflow() override {
+        int_type c = target->sbumpc();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            char ch = traits_type::to_char_type(c);
+            crc.update(&ch, 1);
+        }
+        return c;
+    }
+
+    std::streamsize xsgetn(char *s, std::streamsize n) override {
+        std::streamsize read = target->sgetn(s, n);
+        crc.update(s, static_cast<std::size_t>(read));
+        return read;
+    }
+
+    int sync() override {
+        return target->pubsync();
+    }
+
+  private:
+    std::streambuf *target;
+    Crc32 crc;
+};
+
+// Fixed-width integers are stored little-endian.
+template <typename T>
+void write_integer(std::ostream &out, T value) {
+    static_assert(std::is_unsigned_v<T>);
+    char bytes[sizeof(T)];
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        bytes[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+    out.write(bytes, sizeof(T));
+}
+
+template <typename T>
+T read_integer(std::istream &in) {
+    static_assert(std::is_unsigned_v<T>);
+    unsigned char bytes[sizeof(T)] = {};
+    in.read(reinterpret_cast<char *>(bytes), sizeof(T));
+    T value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value |= static_cast<T>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+// Bulk variants for adjacency lists: a single stream call on little-endian hosts.
+inline void write_integers(std::ostream &out, std::vector<std::uint32_t> const &values) {
+    if constexpr (std::endian::native == std::endian::little) {
+        out.write(reinterpret_cast<char const *>(values.data()),
+                  static_cast<std::streamsize>(values.size() * sizeof(std::uint32_t)));
+    } else {
+        for (std::uint32_t value : values) {
+            write_integer(out, value);
+        }
+    }
+}
+
+inline void read_integers(std::istream &in, std::vector<std::uint32_t> &values) {
+    if constexpr (std::endian::native == std::endian::little) {
+        in.read(reinterpret_cast<char *>(values.data()),
+                static_cast<std::streamsize>(values.size() * sizeof(std::uint32_t)));
+    } else {
+        for (std::uint32_t &value : values) {
+            value = read_integer<std::uint32_t>(in);
+        }
+    }
+}
+
+} // namespace virus_genealogy_detail
+
+// Indeksuje węzły genealogii drzewem (std::map). Wymaga jedynie
+// porządku liniowego na identyfikatorach wirusów.
+struct OrderedStorage {
+    template <typename Key, typename Value>
+    using table = virus_genealogy_detail::OrderedTable<Key, Value>;
+};
+
+// Indeksuje węzły genealogii tablicą haszującą z adresowaniem otwartym,
+// co daje oczekiwany stały czas wyszukiwania. Wymaga, aby dla typu
+// Virus::id_type była zdefiniowana specjalizacja std::hash.
+struct HashStorage {
+    template <typename Key, typename Value>
+    using table = virus_genealogy_detail::HashTable<Key, Value>;
+};
+
+// Indeksuje węzły genealogii wektorem adresowanym bezpośrednio
+// identyfikatorem. Przeznaczone dla całkowitoliczbowych, nieujemnych
+// i nadawanych mniej więcej po kolei identyfikatorów; pamięć jest
+// proporcjonalna do największego użytego identyfikatora.
+struct DenseStorage {
+    template <typename Key, typename Value>
+    using table = virus_genealogy_detail::DenseTable<Key, Value>;
+};
+
+// Zapisuje i odczytuje identyfikatory oraz dane wirusów w plikach
+// tworzonych przez VirusGenealogy::save(). Ta wersja obsługuje
+// identyfikatory całkowitoliczbowe i napisy, a wirus odtwarza z samego
+// identyfikatora. Wirusy z dodatkowymi danymi wymagają specjalizacji tego
+// szablonu lub własnej klasy z tymi samymi metodami statycznymi.
+template <typename Virus>
+struct VirusSerializer {
+    using id_type = typename Virus::id_type;
+
+    static void write_id(std::ostream &out, id_type const &id) {
+        if constexpr (std::is_integral_v<id_type>) {
+            virus_genealogy_detail::write_integer(out, static_cast<std::uint64_t>(id));
+        } else {
+            static_assert(std::is_same_v<id_type, std::string>,
+                          "VirusSerializer must be specialized for this Virus::id_type");
+            virus_genealogy_detail::write_integer(out, static_cast<std::uint64_t>(id.size()));
+            out.write(id.data(), static_cast<std::streamsize>(id.size()));
+        }
+    }
+
+    static id_type read_id(std::istream &in) {
+        if constexpr (std::is_integral_v<id_type>) {
+            return static_cast<id_type>(virus_genealogy_detail::read_integer<std::uint64_t>(in));
+        } else {
+            static_assert(std::is_same_v<id_type, std::string>,
+                          "VirusSerializer must be specialized for this Virus::id_type");
+            std::uint64_t size = virus_genealogy_detail::read_integer<std::uint64_t>(in);
+            std::string id;
+            // Grows in chunks, so a corrupted size fails on the stream rather than on allocation.
+            while (in && id.size() < size) {
+                std::size_t old_size = id.size();
+                std::uint64_t chunk = std::min<std::uint64_t>(size - old_size, 4096);
+                id.resize(old_size + static_cast<std::size_t>(chunk));
+                in.read(id.data() + old_size, static_cast<std::streamsize>(id.size() - old_size));
+            }
+            return id;
+        }
+    }
+
+    static void write_virus(std::ostream &, Virus const &) {
+    }
+
+    static std::shared_ptr<Virus> read_virus(std::istream &, id_type const &id) {
+        return std::make_shared<Virus>(id);
+    }
+};
+
+template <typename Virus, typename Storage = OrderedStorage>
+class FrozenVirusGenealogy;
+
+template <typename Virus, typename Storage = OrderedStorage>
+class VirusGenealogy {
+    class Node;
+    struct State;
+    using handle_type = std::uint32_t;
+
+    using NodeArray = virus_genealogy_detail::PagedArray<Node>;
+
+    // The stem is created first and can never be removed.
+    static constexpr handle_type stem_handle = 0;
+    static constexpr handle_type no_handle = std::numeric_limits<handle_type>::max();
+
+  public:
+    // Zakres sąsiadów wirusa w genealogii. Nie kopiuje danych; pozostaje
+    // ważny do najbliższej modyfikacji genealogii.
+    template <typename It>
+    class HandleView {
+      public:
+        HandleView(It first, It last) : first(first), last(last) {
+        }
+
+        It begin() const {
+            return first;
+        }
+
+        It end() const {
+            return last;
+        }
+
+        std::size_t size() const {
+            return static_cast<std::size_t>(last - first);
+        }
+
+        bool empty() const {
+            return first == last;
+        }
+
+        typename It::reference operator[](std::size_t n) const {
+            return first[static_cast<std::ptrdiff_t>(n)];
+        }
+
+      private:
+        It first;
+        It last;
+    };
+
+    using Iterator =
+        virus_genealogy_detail::IndexIterator<State, virus_genealogy_detail::VirusProjection<Virus>>;
+    using children_iterator = Iterator;
+    using ChildrenView = HandleView<children_iterator>;
+
+    using ParentIterator = virus_genealogy_detail::IndexIterator<
+        State, virus_genealogy_detail::IdProjection<typename Virus::id_type>>;
+    using parents_iterator = ParentIterator;
+    using ParentsView = HandleView<parents_iterator>;
+
+    VirusGenealogy(const VirusGenealogy &) = delete;
+    VirusGenealogy &operator=(const VirusGenealogy &) = delete;
+
+    // Tworzy nową genealogię.
+    // Tworzy także węzeł wirusa macierzystego o identyfikatorze stem_id.
+    explicit VirusGenealogy(typename Virus::id_type const &stem_id) : stem_id(stem_id) {
+        state->index.insert(stem_id, allocate_node(stem_id));
+        // No count is kept until a query asks for one, so that a genealogy
+        // grown without queries never walks up to update them.
+        close_all_clades();
+    }
+
+    // Tworzy genealogię o wirusie macierzystym stem_id i krawędziach
+    // z zakresu edges, złożonego z par {child_id, parent_id}. Powtórzone
+    // krawędzie są pomijane.
+    // Zgłasza wyjątek VirusNotFound, jeśli któryś wirus inny niż macierzysty
+    // nie ma żadnego poprzednika. Zakres jest przeglądany jednokrotnie.
+    template <std::ranges::input_range EdgeRange>
+    VirusGenealogy(typename Virus::id_type const &stem_id, EdgeRange &&edges) : stem_id(stem_id) {
+        // Copies of both ends of every edge, {child, parent} in turn: the
+        // range may yield its pairs by value and may not be traversable twice.
+        std::vector<typename Virus::id_type> ends;
+        if constexpr (std::ranges::sized_range<EdgeRange>) {
+            ends.reserve(2 * static_cast<std::size_t>(std::ranges::size(edges)));
+        }
+
+        for (auto &&[child_id, parent_id] : edges) {
+            ends.push_back(child_id);
+            ends.push_back(parent_id);
+        }
+
+        std::vector<typename Virus::id_type> ids;
+        ids.reserve(ends.size());
+        for (auto const &id : ends) {
+            if (!(id == stem_id)) {
+                ids.push_back(id);
+            }
+        }
+
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        if (ids.size() >= std::numeric_limits<handle_type>::max()) {
+            throw std::length_error("VirusGenealogy node limit exceeded");
+        }
+
+        // The stem gets handle 0, the remaining ids follow in increasing order.
+        auto handle_of = [&](typename Virus::id_type const &id) {
+            if (id == stem_id) {
+                return stem_handle;
+            }
+            auto pos = std::lower_bound(ids.begin(), ids.end(), id);
+            return static_cast<handle_type>(pos - ids.begin() + 1);
+        };
+
+        std::vector<std::pair<handle_type, handle_type>> links;
+        links.reserve(ends.size() / 2);
+
+        for (std::size_t i = 0; i < ends.size(); i += 2) {
+            links.emplace_back(handle_of(ends[i + 1]), handle_of(ends[i]));
+        }
+        ends.clear();
+        ends.shrink_to_fit();
+
+        std::sort(links.begin(), links.end());
+        links.erase(std::unique(links.begin(), links.end()), links.end());
+
+        reserve_nodes(ids.size() + 1);
+        state->nodes.emplace_back(stem_id);
+        for (auto &id : ids) {
+            state->nodes.emplace_back(std::move(id));
+        }
+
+        std::vector<std::uint32_t> parent_counts(state->nodes.size(), 0);
+        for (auto [parent, child] : links) {
+            ++parent_counts[child];
+        }
+        for (std::size_t i = 0; i < state->nodes.size(); ++i) {
+            state->nodes.mut(i).parents.reserve(parent_counts[i]);
+        }
+
+        for (std::size_t begin = 0, end = 0; begin < links.size(); begin = end) {
+            handle_type parent = links[begin].first;
+            while (end < links.size() && links[end].first == parent) {
+                ++end;
+            }
+            state->nodes.mut(parent).children.reserve(end - begin);
+            for (std::size_t i = begin; i < end; ++i) {
+                state->nodes.mut(parent).children.push_back(links[i].second);
+                state->nodes.mut(links[i].second).parents.push_back(parent);
+            }
+        }
+
+        for (std::size_t i = 0; i < state->nodes.size(); ++i) {
+            if (state->nodes[i].parents.empty() && i != stem_handle) {
+                throw VirusNotFound();
+            }
+            // Adjacency arrives in handle order, which is id order except for the stem.
+            move_stem_into_place(state->nodes.mut(i).parents);
+            move_stem_into_place(state->nodes.mut(i).children);
+        }
+
+        state->index.reserve(state->nodes.size());
+        for (std::size_t i = 0; i < state->nodes.size(); ++i) {
+            state->index.insert(state->nodes[i].id, static_cast<handle_type>(i));
+        }
+
+        for (handle_type handle : sorted_topologically()) {
+            state->nodes.mut(handle).generation = generation_from_parents(handle, [this](handle_type parent) {
+                return &state->nodes[parent].generation;
+            });
+        }
+        clades.resize(state->nodes.size());
+        close_all_clades();
+    }
+
+    // Zwraca identyfikator wirusa macierzystego.
+    typename Virus::id_type get_stem_id() const noexcept {
+        return stem_id;
+    }
+
+    // Zwraca iterator pozwalający przeglądać listę identyfikatorów
+    // bezpośrednich następników wirusa o podanym identyfikatorze.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    // Iterator musi spełniać koncept bidirectional_iterator oraz
+    // typeid(*v.get_children_begin()) == typeid(const Virus &).
+    children_iterator get_children_begin(typename Virus::id_type const &id) const {
+        auto const &children = state->nodes[find_handle(id)].children;
+        return Iterator(children.data(), *state);
+    }
+
+    // Iterator wskazujący na element za końcem wyżej wspomnianej listy.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    children_iterator get_children_end(typename Virus::id_type const &id) const {
+        auto const &children = state->nodes[find_handle(id)].children;
+        return Iterator(children.data() + children.size(), *state);
+    }
+
+    // Zwraca listę identyfikatorów bezpośrednich poprzedników wirusa
+    // o podanym identyfikatorze.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::vector<typename Virus::id_type> get_parents(typename Virus::id_type const &id) const {
+        Node const &node = state->nodes[find_handle(id)];
+        std::vector<typename Virus::id_type> parent_ids;
+        parent_ids.reserve(node.parents.size());
+
+        for (handle_type parent : node.parents) {
+            parent_ids.push_back(state->nodes[parent].id);
+        }
+
+        return parent_ids;
+    }
+
+    // Zwraca zakres identyfikatorów bezpośrednich poprzedników wirusa
+    // o podanym identyfikatorze, uporządkowanych rosnąco, bez alokowania
+    // pamięci.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    ParentsView parents(typename Virus::id_type const &id) const {
+        Node const &node = state->nodes[find_handle(id)];
+        return ParentsView(parents_iterator(node.parents.data(), *state),
+                           parents_iterator(node.parents.data() + node.parents.size(), *state));
+    }
+
+    // Zwraca zakres bezpośrednich następników wirusa o podanym
+    // identyfikatorze, uporządkowanych rosnąco według identyfikatorów.
+    // Iteratory zakresu są iteratorami o dostępie swobodnym.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    ChildrenView children(typename Virus::id_type const &id) const {
+        Node const &node = state->nodes[find_handle(id)];
+        return ChildrenView(children_iterator(node.children.data(), *state),
+                            children_iterator(node.children.data() + node.children.size(), *state));
+    }
+
+    // Zwraca liczbę bezpośrednich następników wirusa o podanym identyfikatorze.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::size_t children_count(typename Virus::id_type const &id) const {
+        return state->nodes[find_handle(id)].children.size();
+    }
+
+    // Zwraca liczbę bezpośrednich poprzedników wirusa o podanym identyfikatorze.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::size_t parents_count(typename Virus::id_type const &id) const {
+        return state->nodes[find_handle(id)].parents.size();
+    }
+
+    // Sprawdza, czy wirus o podanym identyfikatorze istnieje.
+    bool exists(typename Virus::id_type const &id) const noexcept {
+        return std::as_const(state->index).find(id) != nullptr;
+    }
+
+    // Zwraca referencję do obiektu reprezentującego wirus o podanym
+    // identyfikatorze.
+    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
+    const Virus &operator[](typename Virus::id_type const &id) const {
+        return *state->nodes[find_handle(id)].virus;
+    }
+
+    // Jak operator[], ale zwraca wskaźnik współdzielący własność wirusa,
+    // który pozostaje ważny także po usunięciu wirusa z genealogii.
+    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
+    std::shared_ptr<const Virus> get_virus(typename Virus::id_type const &id) const {
+        return state->nodes[find_handle(id)].virus;
+    }
+
+    // Tworzy węzeł reprezentujący nowy wirus o identyfikatorze id
+    // powstały z wirusów o podanych identyfikatorach parent_ids.
+    // Zgłasza wyjątek VirusAlreadyCreated, jeśli wirus o identyfikatorze
+    // id już istnieje.
+    // Zgłasza wyjątek VirusNotFound, jeśli któryś z wyspecyfikowanych
+    // poprzedników nie istnieje.
+    void create(typename Virus::id_type const &id,
+                std::vector<typename Virus::id_type> const &parent_ids) {
+        create_from(id, parent_ids);
+    }
+
+    void create(typename Virus::id_type &&id,
+                std::vector<typename Virus::id_type> const &parent_ids) {
+        create_from(std::move(id), parent_ids);
+    }
+
+    // Tworzy węzeł reprezentujący nowy wirus o identyfikatorze id
+    // powstały z wirusa o podanym identyfikatorze parent_id.
+    // Zgłasza wyjątek VirusAlreadyCreated, jeśli wirus o identyfikatorze
+    // id już istnieje.
+    // Zgłasza wyjątek VirusNotFound, jeśli któryś z wyspecyfikowanych
+    // poprzedników nie istnieje.
+    void create(typename Virus::id_type const &id, typename Virus::id_type const &parent_id) {
+        create_from(id, parent_id);
+    }
+
+    void create(typename Virus::id_type &&id, typename Virus::id_type const &parent_id) {
+        create_from(std::move(id), parent_id);
+    }
+
+    // Działa jak create(id, parent_ids), ale obiekt wirusa jest tworzony
+    // w miejscu z argumentów (id, args...).
+    template <typename... Args>
+    void emplace_create(typename Virus::id_type id,
+                        std::vector<typename Virus::id_type> const &parent_ids, Args &&...args) {
+        create_from(std::move(id), parent_ids, std::forward<Args>(args)...);
+    }
+
+    // Tworzy węzły dla wszystkich par {id, parent_ids} z zakresu batch, tak
+    // jak kolejne wywołania create(id, parent_ids). Poprzednikami mogą być
+    // także wirusy utworzone wcześniej w tej samej partii.
+    // Zgłasza wyjątki VirusAlreadyCreated i VirusNotFound w tych samych
+    // sytuacjach co create(); wtedy żaden wirus z partii nie zostaje utworzony.
+    template <typename Range>
+    void create_batch(Range const &batch) {
+        // Ids are copied: the range may yield its elements by value.
+        struct Pending {
+            typename Virus::id_type id;
+            std::vector<handle_type> parents;
+        };
+        std::vector<Pending> pending;
+        typename Storage::template table<typename Virus::id_type, handle_type> batch_index{};
+        // The handles successive allocate_node() calls are going to return.
+        handle_type next_free = state->free_head;
+        std::size_t next_appended = state->nodes.size();
+        auto next_handle = [&] {
+            if (next_free == no_handle) {
+                return static_cast<handle_type>(next_appended++);
+            }
+            return std::exchange(next_free, state->nodes[next_free].next_free);
+        };
+
+        for (auto const &[id, parent_ids] : batch) {
+            if (std::empty(parent_ids)) {
+                continue;
+            }
+            if (std::as_const(state->index).find(id) != nullptr || batch_index.find(id) != nullptr) {
+                throw VirusAlreadyCreated();
+            }
+
+            std::vector<handle_type> parents;
+            parents.reserve(std::size(parent_ids));
+
+            for (auto const &parent_id : parent_ids) {
+                handle_type const *parent = std::as_const(state->index).find(parent_id);
+                if (parent == nullptr) {
+                    parent = batch_index.find(parent_id);
+                }
+                if (parent == nullptr) {
+                    throw VirusNotFound();
+                }
+                parents.push_back(*parent);
+            }
+
+            batch_index.insert(id, next_handle());
+            pending.push_back({id, std::move(parents)});
+        }
+
+        detach();
+        std::size_t reused = std::min(pending.size(), state->free_count);
+        std::size_t appended = pending.size() - reused;
+        if (appended > std::numeric_limits<handle_type>::max() - state->nodes.size()) {
+            throw std::length_error("VirusGenealogy node limit exceeded");
+        }
+        reserve_nodes(state->nodes.size() + appended);
+        state->index.reserve(state->index.size() + pending.size());
+
+        std::vector<handle_type> created;
+        created.reserve(pending.size());
+
+        try {
+            for (auto &entry : pending) {
+                created.push_back(create_node(entry.id, std::move(entry.parents)));
+            }
+        } catch (std::exception &e) {
+            while (!created.empty()) {
+                discard_leaf(created.back());
+                created.pop_back();
+            }
+            // Cheaper than undoing the descendant counts node by node.
+            close_all_clades();
+            throw;
+        }
+    }
+
+    // Dodaje nową krawędź w grafie genealogii.
+    // Zgłasza wyjątek VirusNotFound, jeśli któryś z podanych wirusów nie istnieje.
+    // Przy włączonym wykrywaniu cykli zgłasza wyjątek TriedToCreateCycle,
+    // jeśli krawędź utworzyłaby cykl; wtedy genealogia pozostaje niezmieniona.
+    void connect(typename Virus::id_type const &child_id,
+                 typename Virus::id_type const &parent_id) {
+        handle_type child = find_handle(child_id);
+        handle_type parent = find_handle(parent_id);
+
+        auto const &old_parents = state->nodes[child].parents;
+        if (std::binary_search(old_parents.begin(), old_parents.end(), parent, id_order())) {
+            return;
+        }
+        auto reordering = plan_reordering(parent, child);
+        auto generations = plan_generations({child}, [](handle_type) { return false; }, {parent, child});
+        auto stale = unclosed_ancestors({parent});
+        detach();
+        own_nodes(generations);
+
+        auto &child_parents = state->nodes.mut(child).parents;
+        auto pos = child_parents.insert(
+            std::lower_bound(child_parents.begin(), child_parents.end(), parent, id_order()), parent);
+
+        try {
+            insert_sorted(state->nodes.mut(parent).children, child);
+        } catch (std::exception &e) {
+            child_parents.erase(pos);
+            throw;
+        }
+        for (auto [handle, position] : reordering) {
+            place_in_order(handle, position);
+        }
+        for (auto [handle, generation] : generations) {
+            move_between_depths(handle, state->nodes[handle].generation, generation);
+            state->nodes.mut(handle).generation = generation;
+        }
+        for (handle_type handle : stale) {
+            clades[handle].state = CladeState::closed;
+        }
+        invalidate_indexes();
+    }
+
+    // Usuwa wirus o podanym identyfikatorze.
+    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
+    // Zgłasza wyjątek TriedToRemoveStemVirus przy próbie usunięcia
+    // wirusa macierzystego.
+    void remove(typename Virus::id_type const &id) {
+        Cascade cascade = removal_cascade(id);
+        detach();
+
+        std::vector<handle_type> orphaned;
+        std::vector<handle_type> bereaved;
+        for (handle_type handle : cascade.removed) {
+            for (handle_type child : state->nodes[handle].children) {
+                if (!cascade.contains(child)) {
+                    orphaned.push_back(child);
+                }
+            }
+            for (handle_type parent : state->nodes[handle].parents) {
+                if (!cascade.contains(parent)) {
+                    bereaved.push_back(parent);
+                }
+            }
+        }
+        auto generations = plan_generations(
+            orphaned, [&cascade](handle_type handle) { return cascade.contains(handle); });
+        auto stale = unclosed_ancestors(bereaved);
+        own_nodes(cascade.removed);
+        own_nodes(orphaned);
+        own_nodes(bereaved);
+        own_nodes(generations);
+        for (handle_type handle : cascade.removed) {
+            state->index.own(state->nodes[handle].id);
+        }
+
+        // Nothing below allocates or throws: the whole cascade is committed at once.
+        for (handle_type handle : cascade.removed) {
+            Node const &node = state->nodes[handle];
+            for (handle_type parent : node.parents) {
+                if (!cascade.contains(parent)) {
+                    erase_sorted(state->nodes.mut(parent).children, handle);
+                }
+            }
+            for (handle_type child : node.children) {
+                if (!cascade.contains(child)) {
+                    erase_sorted(state->nodes.mut(child).parents, handle);
+                }
+            }
+        }
+
+        for (handle_type handle : cascade.removed) {
+            move_between_depths(handle, state->nodes[handle].generation, std::nullopt);
+            erase_from_order(handle);
+            state->index.erase(state->nodes[handle].id);
+            release_node(handle);
+        }
+        for (auto [handle, generation] : generations) {
+            move_between_depths(handle, state->nodes[handle].generation, generation);
+            state->nodes.mut(handle).generation = generation;
+        }
+        for (handle_type handle : stale) {
+            clades[handle].state = CladeState::closed;
+        }
+        invalidate_indexes();
+    }
+
+    // Zwraca liczbę wirusów, które usunęłoby wywołanie remove(id), łącznie
+    // z wirusem o identyfikatorze id. Nie modyfikuje genealogii.
+    // Zgłasza te same wyjątki co remove(id).
+    std::size_t remove_preview(typename Virus::id_type const &id) const {
+        return removal_cascade(id).removed.size();
+    }
+
+    // Jak wyżej, a dodatkowo zapisuje identyfikatory tych wirusów do out.
+    template <typename OutputIt>
+    std::size_t remove_preview(typename Virus::id_type const &id, OutputIt out) const {
+        Cascade cascade = removal_cascade(id);
+
+        for (handle_type handle : cascade.removed) {
+            *out++ = state->nodes[handle].id;
+        }
+
+        return cascade.removed.size();
+    }
+
+    // Wywołuje visitor dla każdego potomka wirusa o podanym identyfikatorze
+    // (bez niego samego), każdego dokładnie raz, w podanej kolejności.
+    // Visitor przyjmuje (const Virus &) lub (const Virus &, std::size_t
+    // głębokość); jeśli zwróci false, przeglądanie jest przerywane.
+    // Pomija wirusy położone głębiej niż max_depth krawędzi od początkowego;
+    // w porządku depth_first głębokość liczona jest wzdłuż ścieżki przeszukiwania.
+    // Zwraca false, jeśli przeglądanie zostało przerwane.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    template <typename Visitor>
+    bool for_each_descendant(typename Virus::id_type const &id, Visitor &&visitor,
+                             TraversalOrder order = TraversalOrder::breadth_first,
+                             std::size_t max_depth = std::numeric_limits<std::size_t>::max()) const {
+        return traverse(find_handle(id), &Node::children, visitor, order, max_depth);
+    }
+
+    // Zwraca identyfikatory potomków wirusa o podanym identyfikatorze
+    // w kolejności, w jakiej odwiedza je for_each_descendant.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::vector<typename Virus::id_type>
+    descendants(typename Virus::id_type const &id,
+                TraversalOrder order = TraversalOrder::breadth_first,
+                std::size_t max_depth = std::numeric_limits<std::size_t>::max()) const {
+        std::vector<typename Virus::id_type> result;
+        for_each_descendant(
+            id, [&result](const Virus &virus) { result.push_back(virus.get_id()); }, order, max_depth);
+        return result;
+    }
+
+    // Wywołuje visitor dla każdego przodka wirusa o podanym identyfikatorze
+    // (bez niego samego), każdego dokładnie raz, na tych samych zasadach co
+    // for_each_descendant. W porządku topological wirus macierzysty jest
+    // odwiedzany pierwszy.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    template <typename Visitor>
+    bool for_each_ancestor(typename Virus::id_type const &id, Visitor &&visitor,
+                           TraversalOrder order = TraversalOrder::breadth_first,
+                           std::size_t max_depth = std::numeric_limits<std::size_t>::max()) const {
+        return traverse(find_handle(id), &Node::parents, visitor, order, max_depth);
+    }
+
+    // Zwraca identyfikatory przodków wirusa o podanym identyfikatorze
+    // w kolejności, w jakiej odwiedza je for_each_ancestor.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::vector<typename Virus::id_type>
+    ancestors(typename Virus::id_type const &id,
+              TraversalOrder order = TraversalOrder::breadth_first,
+              std::size_t max_depth = std::numeric_limits<std::size_t>::max()) const {
+        std::vector<typename Virus::id_type> result;
+        for_each_ancestor(
+            id, [&result](const Virus &virus) { result.push_back(virus.get_id()); }, order, max_depth);
+        return result;
+    }
+
+    // Wywołuje visitor(const Virus &) dla każdego wirusa genealogii,
+    // równolegle na wątkach puli, w nieokreślonej kolejności; visitor musi
+    // więc dopuszczać wywołania współbieżne. Genealogii nie wolno w tym
+    // czasie modyfikować; analizy trwające podczas modyfikacji powinny
+    // działać na migawce zwróconej przez snapshot().
+    template <typename Visitor>
+    void parallel_for_each_node(Visitor &&visitor,
+                                WorkStealingPool &pool = WorkStealingPool::shared()) const {
+        NodeArray const &nodes = state->nodes;
+        pool.parallel_for(0, nodes.size(), parallel_grain, [&](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; ++i) {
+                if (nodes[i].virus != nullptr) {
+                    visitor(*nodes[i].virus);
+                }
+            }
+        });
+    }
+
+    // Jak for_each_descendant w porządku breadth_first, ale każdy poziom
+    // przeszukiwania jest przetwarzany równolegle na wątkach puli, a kolejność
+    // w obrębie poziomu jest nieokreślona. Głębokość przekazywana visitorowi
+    // to długość najkrótszej ścieżki od wirusa początkowego. Jeśli visitor
+    // zwróci false, kolejne poziomy nie są przeglądane. Wymagania co do
+    // visitora i modyfikacji są takie jak w parallel_for_each_node.
+    // Zwraca false, jeśli przeglądanie zostało przerwane.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    template <typename Visitor>
+    bool parallel_for_each_descendant(typename Virus::id_type const &id, Visitor &&visitor,
+                                      WorkStealingPool &pool = WorkStealingPool::shared()) const {
+        NodeArray const &nodes = state->nodes;
+        handle_type start = find_handle(id);
+
+        // One bit per handle, claimed with fetch_or, so each node joins one level only.
+        std::vector<std::atomic<std::uint64_t>> visited((nodes.size() + 63) / 64);
+        visited[start / 64].store(std::uint64_t{1} << (start % 64), std::memory_order_relaxed);
+
+        std::vector<handle_type> frontier{start};
+        std::vector<handle_type> next;
+        std::mutex next_mutex;
+        std::atomic<bool> stopped{false};
+
+        for (std::size_t depth = 1; !frontier.empty(); ++depth) {
+            pool.parallel_for(0, frontier.size(), parallel_grain, [&](std::size_t first, std::size_t last) {
+                std::vector<handle_type> found;
+                for (std::size_t i = first; i < last; ++i) {
+                    for (handle_type child : nodes[frontier[i]].children) {
+                        std::uint64_t bit = std::uint64_t{1} << (child % 64);
+                        auto &word = visited[child / 64];
+                        if ((word.load(std::memory_order_relaxed) & bit) ||
+                            (word.fetch_or(bit, std::memory_order_relaxed) & bit)) {
+                            continue;
+                        }
+                        found.push_back(child);
+                        if (!stopped.load(std::memory_order_relaxed) &&
+                            !visit(visitor, nodes[child], depth)) {
+                            stopped.store(true, std::memory_order_relaxed);
+                        }
+                    }
+                }
+                std::lock_guard<std::mutex> lock(next_mutex);
+                next.insert(next.end(), found.begin(), found.end());
+            });
+
+            if (stopped.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            frontier.swap(next);
+            next.clear();
+        }
+
+        return true;
+    }
+
+    // Sprawdza, czy wirus o identyfikatorze ancestor_id jest przodkiem wirusa
+    // o identyfikatorze id, tzn. czy istnieje niepusta ścieżka od pierwszego
+    // do drugiego. Korzysta z indeksu osiągalności budowanego przy pierwszym
+    // zapytaniu po każdej modyfikacji genealogii.
+    // Zgłasza wyjątek VirusNotFound, jeśli któryś z wirusów nie istnieje.
+    bool is_ancestor(typename Virus::id_type const &ancestor_id,
+                     typename Virus::id_type const &id) const {
+        handle_type ancestor = find_handle(ancestor_id);
+        handle_type handle = find_handle(id);
+        if (ancestor == handle) {
+            return false;
+        }
+
+        return reaches(reachability_index(), ancestor, handle);
+    }
+
+    // Zwraca rosnąco uporządkowane identyfikatory najniższych wspólnych
+    // przodków wirusów o identyfikatorach id1 i id2: wspólnych przodków,
+    // których żaden następnik nie jest wspólnym przodkiem. Tutaj każdy wirus
+    // jest także swoim własnym przodkiem, więc jeśli id1 jest przodkiem id2,
+    // to wynikiem jest {id1}. Korzysta z indeksu osiągalności is_ancestor
+    // oraz z indeksu drzew tworzonych przez wirusy o jednym poprzedniku,
+    // budowanego przy pierwszym zapytaniu po każdej modyfikacji genealogii.
+    // Jeśli oba wirusy leżą w jednym takim drzewie, zapytanie działa
+    // w czasie logarytmicznym względem jego głębokości; w przeciwnym razie
+    // przegląda tylko wirusy o wielu poprzednikach wśród przodków jednego
+    // z nich.
+    // Zgłasza wyjątek VirusNotFound, jeśli któryś z wirusów nie istnieje.
+    std::vector<typename Virus::id_type>
+    lowest_common_ancestors(typename Virus::id_type const &id1,
+                            typename Virus::id_type const &id2) const {
+        handle_type first = find_handle(id1);
+        handle_type second = find_handle(id2);
+        ReachabilityIndex const &labels = reachability_index();
+        if (first == second || reaches(labels, first, second)) {
+            return {state->nodes[first].id};
+        }
+        if (reaches(labels, second, first)) {
+            return {state->nodes[second].id};
+        }
+
+        // Within one tree the ancestries are tree paths, which meet at the
+        // deepest tree ancestor containing both.
+        LcaForest const &forest = lca_forest();
+        handle_type root1 = forest.entries[first].root;
+        handle_type root2 = forest.entries[second].root;
+        if (root1 == root2) {
+            handle_type lowest = *forest.deepest_ancestor(
+                first, [&](handle_type handle) { return forest.tree_contains(handle, second); });
+            return {state->nodes[lowest].id};
+        }
+
+        // A common ancestor on the tree path strictly below a root is the only
+        // lowest one: every other common ancestor lies above it on that path
+        // or above the root.
+        for (auto [from, to] : {std::pair{first, second}, std::pair{second, first}}) {
+            auto common = forest.deepest_ancestor(
+                from, [&](handle_type handle) { return reaches(labels, handle, to); });
+            if (common && *common != forest.entries[from].root) {
+                return {state->nodes[*common].id};
+            }
+        }
+
+        // Otherwise the common ancestors are those of both roots, themselves
+        // included.
+        if (reaches(labels, root1, root2)) {
+            return {state->nodes[root1].id};
+        }
+        if (reaches(labels, root2, root1)) {
+            return {state->nodes[root2].id};
+        }
+
+        // Walk up from the root with the shorter ancestry, a tree path at a
+        // time, stopping at common ancestors: everything above them is common
+        // too, but not lowest.
+        handle_type from = root1;
+        handle_type to = root2;
+        if (labels.labels[to].level < labels.labels[from].level) {
+            std::swap(from, to);
+        }
+        auto is_common = [&](handle_type handle) {
+            return handle == to || reaches(labels, handle, to);
+        };
+
+        std::vector<handle_type> candidates;
+        virus_genealogy_detail::ScratchLease lease;
+        auto &visited = (*lease).visited;
+        auto &frontier = (*lease).frontier;
+        auto enqueue_parents = [&](handle_type handle) {
+            for (handle_type parent : state->nodes[handle].parents) {
+                if (visited.insert(parent)) {
+                    frontier.emplace_back(parent, 0);
+                }
+            }
+        };
+
+        enqueue_parents(from);
+        for (std::size_t i = 0; i < frontier.size(); ++i) {
+            handle_type handle = frontier[i].first;
+            if (is_common(handle)) {
+                candidates.push_back(handle);
+            } else if (auto common = forest.deepest_ancestor(handle, is_common)) {
+                candidates.push_back(*common);
+            } else {
+                enqueue_parents(forest.entries[handle].root);
+            }
+        }
+
+        // A candidate reached over a path avoiding other common ancestors may
+        // still lie above another candidate. Ancestors have lower levels, so
+        // in order of decreasing level every candidate that is not lowest
+        // reaches one already accepted.
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        std::sort(candidates.begin(), candidates.end(), [&labels](handle_type a, handle_type b) {
+            return labels.labels[a].level > labels.labels[b].level;
+        });
+        std::vector<handle_type> lowest;
+        for (handle_type candidate : candidates) {
+            if (std::none_of(lowest.begin(), lowest.end(),
+                             [&](handle_type other) { return reaches(labels, candidate, other); })) {
+                lowest.push_back(candidate);
+            }
+        }
+
+        std::vector<typename Virus::id_type> result;
+        result.reserve(lowest.size());
+        for (handle_type handle : lowest) {
+            result.push_back(state->nodes[handle].id);
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    // Zwraca identyfikator bezpośredniego dominatora wirusa o podanym
+    // identyfikatorze: najbliższego wirusa leżącego na każdej ścieżce od
+    // wirusa macierzystego do niego. Dla wirusa macierzystego zwraca jego
+    // własny identyfikator. Korzysta z drzewa dominatorów budowanego przy
+    // pierwszym zapytaniu po każdej modyfikacji genealogii.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    typename Virus::id_type immediate_dominator(typename Virus::id_type const &id) const {
+        handle_type handle = find_handle(id);
+        return state->nodes[dominator_tree().idom[handle]].id;
+    }
+
+    // Sprawdza, czy wirus o identyfikatorze dominator_id leży na każdej
+    // ścieżce od wirusa macierzystego do wirusa o identyfikatorze id.
+    // Każdy wirus dominuje sam siebie.
+    // Zgłasza wyjątek VirusNotFound, jeśli któryś z wirusów nie istnieje.
+    bool dominates(typename Virus::id_type const &dominator_id,
+                   typename Virus::id_type const &id) const {
+        handle_type dominator = find_handle(dominator_id);
+        handle_type handle = find_handle(id);
+        return dominator_tree().contains(dominator, handle);
+    }
+
+    // Głębokość wirusa w genealogii: długości najkrótszej i najdłuższej
+    // ścieżki od wirusa macierzystego do niego.
+    struct Depth {
+        std::size_t shortest = 0;
+        std::size_t longest = 0;
+    };
+
+    // Zwraca głębokość wirusa o podanym identyfikatorze w czasie stałym;
+    // głębokości są uaktualniane przy każdej modyfikacji genealogii. Dla
+    // genealogii z cyklami głębokości wirusów na cyklach są nieokreślone.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    Depth depth(typename Virus::id_type const &id) const {
+        Generation generation = state->nodes[find_handle(id)].generation;
+        return {generation.shortest, generation.longest};
+    }
+
+    // Zwraca posortowane identyfikatory wirusów o głębokości depth rodzaju
+    // kind. Korzysta z indeksu budowanego przy pierwszym zapytaniu, który
+    // potem każda modyfikacja uaktualnia w miejscu, więc zapytanie kosztuje
+    // tyle, ile posortowanie zwracanych identyfikatorów.
+    std::vector<typename Virus::id_type> nodes_at_depth(std::size_t depth,
+                                                        DepthKind kind = DepthKind::shortest) const {
+        DepthBuckets const &buckets = kind == DepthKind::shortest
+            ? shortest_buckets.get([this] { return build_depth_buckets(&Generation::shortest); })
+            : longest_buckets.get([this] { return build_depth_buckets(&Generation::longest); });
+
+        std::vector<typename Virus::id_type> result;
+        if (depth < buckets.members.size()) {
+            result.reserve(buckets.members[depth].size());
+            for (handle_type handle : buckets.members[depth]) {
+                result.push_back(state->nodes[handle].id);
+            }
+            std::sort(result.begin(), result.end());
+        }
+
+        return result;
+    }
+
+    // Zwraca liczbę potomków wirusa o podanym identyfikatorze (bez niego
+    // samego). Wynik jest zapamiętywany: utworzenie wirusa jedynie zwiększa
+    // liczniki jego przodków, a connect() i remove() unieważniają je tylko
+    // u przodków zmienionych wirusów.
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::size_t descendant_count(typename Virus::id_type const &id) const {
+        handle_type handle = find_handle(id);
+        std::lock_guard<std::mutex> lock(clade_mutex);
+        // A snapshot starts with no counts, all of them stale.
+        if (clades.size() < state->nodes.size()) {
+            clades.resize(state->nodes.size(), Clade{0, CladeState::closed});
+        }
+        Clade &clade = clades[handle];
+
+        if (clade.state != CladeState::valid) {
+            virus_genealogy_detail::ScratchLease lease;
+            auto &visited = (*lease).visited;
+            auto &frontier = (*lease).frontier;
+            visited.insert(handle);
+            frontier.emplace_back(handle, 0);
+
+            for (std::size_t i = 0; i < frontier.size(); ++i) {
+                for (handle_type child : state->nodes[frontier[i].first].children) {
+                    if (visited.insert(child)) {
+                        frontier.emplace_back(child, 0);
+                    }
+                }
+            }
+            // The descendants now have a valid ancestor.
+            for (std::size_t i = 1; i < frontier.size(); ++i) {
+                Clade &descendant = clades[frontier[i].first];
+                if (descendant.state == CladeState::closed) {
+                    descendant.state = CladeState::open;
+                }
+            }
+            clade.size = static_cast<std::uint32_t>(frontier.size() - 1);
+            clade.state = CladeState::valid;
+        }
+
+        return clade.size;
+    }
+
+    // Zwraca niezmienną kopię genealogii w zwartej postaci (CSR): sąsiedzi
+    // wszystkich wirusów leżą w dwóch ciągłych tablicach, a wirusy są
+    // ponumerowane w kolejności przeszukiwania wszerz od wirusa macierzystego,
+    // więc przeglądanie odwołuje się do pamięci niemal sekwencyjnie.
+    // Wirusy są współdzielone z genealogią, a nie kopiowane.
+    FrozenVirusGenealogy<Virus, Storage> freeze() const {
+        constexpr std::uint32_t unassigned = std::numeric_limits<std::uint32_t>::max();
+        NodeArray const &nodes = state->nodes;
+        FrozenVirusGenealogy<Virus, Storage> frozen(stem_id);
+
+        std::vector<handle_type> order;
+        order.reserve(state->index.size());
+        std::vector<std::uint32_t> dense(nodes.size(), unassigned);
+        auto assign = [&](handle_type handle) {
+            dense[handle] = static_cast<std::uint32_t>(order.size());
+            order.push_back(handle);
+        };
+
+        assign(stem_handle);
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            for (handle_type child : nodes[order[i]].children) {
+                if (dense[child] == unassigned) {
+                    assign(child);
+                }
+            }
+        }
+        // Only nodes on a cycle can be unreachable from the stem.
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].virus != nullptr && dense[i] == unassigned) {
+                assign(static_cast<handle_type>(i));
+            }
+        }
+
+        auto flatten = [&](std::vector<handle_type> Node::*edges, std::vector<std::uint32_t> &offsets,
+                           std::vector<std::uint32_t> &targets) {
+            std::size_t total = 0;
+            for (handle_type handle : order) {
+                total += (nodes[handle].*edges).size();
+            }
+            if (total > std::numeric_limits<std::uint32_t>::max()) {
+                throw std::length_error("FrozenVirusGenealogy edge limit exceeded");
+            }
+
+            offsets.reserve(order.size() + 1);
+            targets.reserve(total);
+            offsets.push_back(0);
+            for (handle_type handle : order) {
+                for (handle_type neighbour : nodes[handle].*edges) {
+                    targets.push_back(dense[neighbour]);
+                }
+                offsets.push_back(static_cast<std::uint32_t>(targets.size()));
+            }
+        };
+        flatten(&Node::children, frozen.child_offsets, frozen.children_targets);
+        flatten(&Node::parents, frozen.parent_offsets, frozen.parent_targets);
+
+        frozen.ids.reserve(order.size());
+        frozen.viruses.reserve(order.size());
+        frozen.index.reserve(order.size());
+        for (handle_type handle : order) {
+            frozen.index.insert(nodes[handle].id, static_cast<std::uint32_t>(frozen.ids.size()));
+            frozen.ids.push_back(nodes[handle].id);
+            frozen.viruses.push_back(nodes[handle].virus);
+        }
+
+        return frozen;
+    }
+
+    // Zapisuje genealogię w formacie binarnym, który load() odczytuje
+    // bezpośrednio, bez odtwarzania kolejnych wywołań create(). Plik zawiera
+    // numer wersji formatu i sumy kontrolne CRC-32. Identyfikatory i dane
+    // wirusów zapisuje Serializer (zob. VirusSerializer).
+    // Zgłasza wyjątek std::ios_base::failure, jeśli zapis się nie powiódł.
+    template <typename Serializer = VirusSerializer<Virus>>
+    void save(std::ostream &out) const {
+        using virus_genealogy_detail::write_integer;
+        NodeArray const &nodes = state->nodes;
+
+        // Removed handles are skipped and the rest keep their order, so the
+        // stem stays first and adjacency lists stay sorted by id.
+        std::vector<handle_type> dense(nodes.size(), 0);
+        std::uint32_t count = 0;
+        std::uint64_t edges = 0;
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].virus != nullptr) {
+                dense[i] = count++;
+                edges += nodes[i].children.size();
+            }
+        }
+
+        virus_genealogy_detail::ChecksumStreamBuf header_buf(out.rdbuf());
+        std::ostream header(&header_buf);
+        write_integer(header, file_magic);
+        write_integer(header, file_version);
+        write_integer(header, count);
+        write_integer(header, edges);
+        write_integer(out, header_buf.checksum());
+
+        virus_genealogy_detail::ChecksumStreamBuf body_buf(out.rdbuf());
+        std::ostream body(&body_buf);
+        std::vector<std::uint32_t> adjacency;
+        auto write_adjacency = [&](std::vector<handle_type> const &handles) {
+            adjacency.clear();
+            for (handle_type handle : handles) {
+                adjacency.push_back(dense[handle]);
+            }
+            write_integer(body, static_cast<std::uint32_t>(adjacency.size()));
+            virus_genealogy_detail::write_integers(body, adjacency);
+        };
+
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            Node const &node = nodes[i];
+            if (node.virus == nullptr) {
+                continue;
+            }
+            Serializer::write_id(body, node.id);
+            Serializer::write_virus(body, *node.virus);
+            write_integer(body, node.generation.shortest);
+            write_integer(body, node.generation.longest);
+            write_adjacency(node.parents);
+            write_adjacency(node.children);
+        }
+        write_integer(out, body_buf.checksum());
+
+        if (!header || !body || !out.flush()) {
+            throw std::ios_base::failure("VirusGenealogy save failed");
+        }
+    }
+
+    // Zapisuje genealogię do pliku o podanej ścieżce, zastępując go.
+    template <typename Serializer = VirusSerializer<Virus>>
+    void save(std::filesystem::path const &path) const {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::ios_base::failure("VirusGenealogy cannot open " + path.string());
+        }
+        save<Serializer>(out);
+    }
+
+    // Odczytuje genealogię zapisaną przez save() z tym samym Serializer.
+    // Zgłasza wyjątek InvalidGenealogyFile, jeśli dane są niekompletne,
+    // uszkodzone lub zapisane w nieobsługiwanej wersji formatu.
+    template <typename Serializer = VirusSerializer<Virus>>
+    static VirusGenealogy load(std::istream &in) {
+        using virus_genealogy_detail::read_integer;
+
+        virus_genealogy_detail::ChecksumStreamBuf header_buf(in.rdbuf());
+        std::istream header(&header_buf);
+        std::uint32_t magic = read_integer<std::uint32_t>(header);
+        std::uint32_t version = read_integer<std::uint32_t>(header);
+        std::uint32_t count = read_integer<std::uint32_t>(header);
+        std::uint64_t edges = read_integer<std::uint64_t>(header);
+        std::uint32_t header_checksum = read_integer<std::uint32_t>(in);
+        // The counts are trusted for allocation only once the header checksum matches.
+        if (!header || !in || header_checksum != header_buf.checksum() || magic != file_magic ||
+            version != file_version || count == 0 || count == std::numeric_limits<handle_type>::max()) {
+            throw InvalidGenealogyFile();
+        }
+
+        auto loaded = std::make_unique<State>();
+        NodeArray &nodes = loaded->nodes;
+        nodes.reserve(count);
+
+        virus_genealogy_detail::ChecksumStreamBuf body_buf(in.rdbuf());
+        std::istream body(&body_buf);
+        std::uint64_t parent_edges = 0;
+        std::uint64_t child_edges = 0;
+        auto read_adjacency = [&](std::vector<handle_type> &handles, std::uint64_t &total) {
+            std::uint32_t size = read_integer<std::uint32_t>(body);
+            total += size;
+            if (!body || size > count || total > edges) {
+                throw InvalidGenealogyFile();
+            }
+            handles.resize(size);
+            virus_genealogy_detail::read_integers(body, handles);
+            for (handle_type handle : handles) {
+                if (handle >= count) {
+                    throw InvalidGenealogyFile();
+                }
+            }
+        };
+
+        for (std::uint32_t i = 0; i < count; ++i) {
+            Node node;
+            node.id = Serializer::read_id(body);
+            node.virus = Serializer::read_virus(body, node.id);
+            node.generation.shortest = read_integer<std::uint32_t>(body);
+            node.generation.longest = read_integer<std::uint32_t>(body);
+            read_adjacency(node.parents, parent_edges);
+            read_adjacency(node.children, child_edges);
+            if (!body || node.virus == nullptr || (node.parents.empty() && i != stem_handle)) {
+                throw InvalidGenealogyFile();
+            }
+            nodes.emplace_back(std::move(node));
+        }
+
+        std::uint32_t body_checksum = read_integer<std::uint32_t>(in);
+        if (!in || body_checksum != body_buf.checksum() || parent_edges != edges || child_edges != edges) {
+            throw InvalidGenealogyFile();
+        }
+
+        // Only now, as a corrupted id could make DenseStorage allocate for it.
+        loaded->index.reserve(count);
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            if (loaded->index.find(nodes[i].id) != nullptr) {
+                throw InvalidGenealogyFile();
+            }
+            loaded->index.insert(nodes[i].id, static_cast<handle_type>(i));
+        }
+
+        // With both lists strictly sorted and equal edge totals, finding every
+        // child edge among the child's parents proves the lists are mirrored.
+        auto by_id = [&nodes](handle_type a, handle_type b) {
+            return nodes[a].id < nodes[b].id;
+        };
+        auto strictly_sorted = [&by_id](std::vector<handle_type> const &handles) {
+            return std::adjacent_find(handles.begin(), handles.end(), [&by_id](handle_type a, handle_type b) {
+                       return !by_id(a, b);
+                   }) == handles.end();
+        };
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            Node const &node = nodes[i];
+            if (!strictly_sorted(node.parents) || !strictly_sorted(node.children)) {
+                throw InvalidGenealogyFile();
+            }
+            for (handle_type child : node.children) {
+                auto const &parents = nodes[child].parents;
+                if (!std::binary_search(parents.begin(), parents.end(), static_cast<handle_type>(i), by_id)) {
+                    throw InvalidGenealogyFile();
+                }
+            }
+        }
+
+        typename Virus::id_type loaded_stem_id = nodes[stem_handle].id;
+        return VirusGenealogy(loaded_stem_id, std::move(loaded));
+    }
+
+    // Odczytuje genealogię z pliku o podanej ścieżce.
+    // Zgłasza wyjątek std::ios_base::failure, jeśli pliku nie da się otworzyć.
+    template <typename Serializer = VirusSerializer<Virus>>
+    static VirusGenealogy load(std::filesystem::path const &path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::ios_base::failure("VirusGenealogy cannot open " + path.string());
+        }
+        return load<Serializer>(in);
+    }
+
+    // Zwraca niezmienną migawkę bieżącego stanu genealogii, ważną bez względu
+    // na późniejsze modyfikacje. Zapytania do migawki nie wymagają
+    // synchronizacji z wątkiem modyfikującym genealogię. Migawka współdzieli
+    // dane z genealogią, więc jej utworzenie działa w czasie stałym. Dane są
+    // podzielone na strony po kilka tysięcy wirusów i modyfikacja po
+    // utworzeniu migawki kopiuje tylko te strony, które zmienia.
+    // Dane są zwalniane wraz z ostatnią korzystającą z nich migawką.
+    std::shared_ptr<const VirusGenealogy> snapshot() const {
+        shared.store(true, std::memory_order_relaxed);
+        return std::shared_ptr<const VirusGenealogy>(new VirusGenealogy(stem_id, state));
+    }
+
+    // Włącza utrzymywanie porządku topologicznego wirusów, dzięki któremu
+    // connect() odrzuca krawędzie tworzące cykl, a topological_order() nie
+    // musi sortować grafu. Koszt connect() zależy wtedy od liczby wirusów,
+    // które trzeba przestawić w porządku.
+    // Zgłasza wyjątek TriedToCreateCycle, jeśli genealogia już zawiera cykl.
+    void enable_cycle_detection() {
+        if (topological.enabled) {
+            return;
+        }
+
+        TopologicalOrder order;
+        order.enabled = true;
+        order.slots = sorted_topologically();
+        if (order.slots.size() != state->index.size()) {
+            throw TriedToCreateCycle();
+        }
+        order.position.resize(state->nodes.size(), 0);
+        for (std::size_t i = 0; i < order.slots.size(); ++i) {
+            order.position[order.slots[i]] = static_cast<std::uint32_t>(i);
+        }
+        topological = std::move(order);
+    }
+
+    // Wyłącza utrzymywanie porządku topologicznego.
+    void disable_cycle_detection() noexcept {
+        topological = TopologicalOrder();
+    }
+
+    bool cycle_detection_enabled() const noexcept {
+        return topological.enabled;
+    }
+
+    // Zwraca identyfikatory wszystkich wirusów w porządku topologicznym:
+    // każdy wirus występuje po wszystkich swoich poprzednikach. Przy
+    // włączonym wykrywaniu cykli odczytuje utrzymywany porządek, w przeciwnym
+    // razie sortuje graf.
+    std::vector<typename Virus::id_type> topological_order() const {
+        std::vector<typename Virus::id_type> result;
+        result.reserve(state->index.size());
+
+        if (topological.enabled) {
+            for (handle_type handle : topological.slots) {
+                if (handle != TopologicalOrder::hole) {
+                    result.push_back(state->nodes[handle].id);
+                }
+            }
+        } else {
+            for (handle_type handle : sorted_topologically()) {
+                result.push_back(state->nodes[handle].id);
+            }
+        }
+
+        return result;
+    }
+
+  private:
+    // A node slot. Edges refer to other nodes by their 32-bit handle, i.e.
+    // their position in the nodes table, so ids are never duplicated per
+    // edge. A slot with no virus is free and linked into the free list
+    // through next_free.
+    // Shortest and longest path from the stem, kept up to date by every
+    // mutation.
+    struct Generation {
+        std::uint32_t shortest = 0;
+        std::uint32_t longest = 0;
+
+        bool operator==(Generation const &) const = default;
+    };
+
+    // Memoized descendant counts. A stale node is open while some of its
+    // ancestors may still be valid, and closed once all of them are known
+    // to be stale too, so walks up the graph stop at closed nodes.
+    enum class CladeState : std::uint8_t {
+        valid,
+        open,
+        closed,
+    };
+
+    struct Clade {
+        std::uint32_t size = 0;
+        CladeState state = CladeState::valid;
+    };
+
+    class Node {
+      public:
+        typename Virus::id_type id{};
+        handle_type next_free = no_handle;
+        std::shared_ptr<Virus> virus;
+        std::vector<handle_type> parents;   // Sorted by id.
+        std::vector<handle_type> children;  // Sorted by id.
+        Generation generation;
+
+        Node() = default;
+
+        template <typename Id, typename... Args>
+            requires std::is_constructible_v<typename Virus::id_type, Id &&>
+        explicit Node(Id &&virus_id, Args &&...args)
+            : id(std::forward<Id>(virus_id)),
+              virus(std::make_shared<Virus>(id, std::forward<Args>(args)...)) {
+        }
+    };
+
+    auto id_order() const noexcept {
+        return [this](handle_type a, handle_type b) { return state->nodes[a].id < state->nodes[b].id; };
+    }
+
+    handle_type find_handle(typename Virus::id_type const &id) const {
+        handle_type const *handle = std::as_const(state->index).find(id);
+        if (handle == nullptr) {
+            throw VirusNotFound();
+        }
+
+        return *handle;
+    }
+
+    template <typename Id, typename... Args>
+    handle_type allocate_node(Id &&id, Args &&...args) {
+        if (state->free_head != no_handle) {
+            handle_type handle = state->free_head;
+            Node node(std::forward<Id>(id), std::forward<Args>(args)...);
+            Node &slot = state->nodes.mut(handle);
+            state->free_head = slot.next_free;
+            --state->free_count;
+            slot = std::move(node);
+            clades[handle] = Clade();
+            return handle;
+        }
+
+        if (state->nodes.size() >= no_handle) {
+            throw std::length_error("VirusGenealogy node limit exceeded");
+        }
+        reserve_nodes(state->nodes.size() + 1);
+        state->nodes.emplace_back(std::forward<Id>(id), std::forward<Args>(args)...);
+        clades.emplace_back();
+        return static_cast<handle_type>(state->nodes.size() - 1);
+    }
+
+    void reserve_nodes(std::size_t count) {
+        state->nodes.reserve(count);
+        if (clades.capacity() < count) {
+            clades.reserve(std::max(count, 2 * clades.capacity()));
+        }
+    }
+
+    // Makes the pages holding the given nodes private to this genealogy, so
+    // that a commit writing to them afterwards does not allocate.
+    template <typename Handles>
+    void own_nodes(Handles const &handles) {
+        for (auto const &entry : handles) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(entry)>, handle_type>) {
+                state->nodes.own(entry);
+            } else {
+                state->nodes.own(entry.first);
+            }
+        }
+    }
+
+    template <typename Id, typename... Args>
+    void create_from(Id &&id, std::vector<typename Virus::id_type> const &parent_ids,
+                     Args &&...args) {
+        if (parent_ids.empty()) {
+            return;
+        }
+        if (std::as_const(state->index).find(id) != nullptr) {
+            throw VirusAlreadyCreated();
+        }
+
+        std::vector<handle_type> parents;
+        parents.reserve(parent_ids.size());
+
+        for (auto const &parent_id : parent_ids) {
+            parents.push_back(find_handle(parent_id));
+        }
+
+        create_node(std::forward<Id>(id), std::move(parents), std::forward<Args>(args)...);
+    }
+
+    template <typename Id>
+    void create_from(Id &&id, typename Virus::id_type const &parent_id) {
+        if (std::as_const(state->index).find(id) != nullptr) {
+            throw VirusAlreadyCreated();
+        }
+
+        create_node(std::forward<Id>(id), std::vector<handle_type>(1, find_handle(parent_id)));
+    }
+
+    // Creates a node with the given existing parents, with the strong
+    // exception guarantee. The id is moved into the node when possible and
+    // the index key is copied from there.
+    template <typename Id, typename... Args>
+    handle_type create_node(Id &&id, std::vector<handle_type> parents, Args &&...args) {
+        std::sort(parents.begin(), parents.end(), id_order());
+        parents.erase(std::unique(parents.begin(), parents.end()), parents.end());
+
+        auto grown = unclosed_ancestors(parents);
+        detach();
+        reserve_order(state->nodes.size() + 1);
+        handle_type handle = allocate_node(std::forward<Id>(id), std::forward<Args>(args)...);
+        state->nodes.mut(handle).parents = std::move(parents);
+        std::size_t linked = 0;
+
+        try {
+            for (handle_type parent : state->nodes[handle].parents) {
+                insert_sorted(state->nodes.mut(parent).children, handle);
+                ++linked;
+            }
+            state->index.insert(state->nodes[handle].id, handle);
+        } catch (std::exception &e) {
+            for (std::size_t i = 0; i < linked; ++i) {
+                erase_sorted(state->nodes.mut(state->nodes[handle].parents[i]).children, handle);
+            }
+            release_node(handle);
+            throw;
+        }
+
+        state->nodes.mut(handle).generation = generation_from_parents(handle, [this](handle_type parent) {
+            return &state->nodes[parent].generation;
+        });
+        move_between_depths(handle, std::nullopt, state->nodes[handle].generation);
+        // The new node is one more descendant of each of its ancestors, so
+        // the valid counts stay valid. The walk ends at closed nodes, and a
+        // node below closed ones only starts closed too, which keeps creating
+        // chains O(1) until some count above them is queried.
+        for (handle_type ancestor : grown) {
+            clades[ancestor].size += clades[ancestor].state == CladeState::valid;
+        }
+        if (grown.empty()) {
+            clades[handle].state = CladeState::closed;
+        }
+        // A new node has no children, so it can go last.
+        if (topological.enabled) {
+            place_in_order(handle, static_cast<std::uint32_t>(topological.slots.size()));
+        }
+        invalidate_indexes();
+        return handle;
+    }
+
+    // Undoes create_node() of a node that has not gained children since.
+    // The pages it writes to were written by create_node() already.
+    void discard_leaf(handle_type handle) noexcept {
+        for (handle_type parent : state->nodes[handle].parents) {
+            erase_sorted(state->nodes.mut(parent).children, handle);
+        }
+        move_between_depths(handle, state->nodes[handle].generation, std::nullopt);
+        erase_from_order(handle);
+        state->index.erase(state->nodes[handle].id);
+        release_node(handle);
+    }
+
+    // Does not allocate if the node's page is owned.
+    void release_node(handle_type handle) noexcept {
+        Node &node = state->nodes.mut(handle);
+        node = Node();
+        node.next_free = state->free_head;
+        state->free_head = handle;
+        ++state->free_count;
+    }
+
+    // Adjacency vectors are kept sorted by id, which gives reproducible
+    // iteration order and binary-search edge lookup.
+    void insert_sorted(std::vector<handle_type> &handles, handle_type handle) {
+        handles.insert(std::lower_bound(handles.begin(), handles.end(), handle, id_order()), handle);
+    }
+
+    void erase_sorted(std::vector<handle_type> &handles, handle_type handle) const noexcept {
+        handles.erase(std::lower_bound(handles.begin(), handles.end(), handle, id_order()));
+    }
+
+    void move_stem_into_place(std::vector<handle_type> &handles) const noexcept {
+        if (!handles.empty() && handles.front() == stem_handle) {
+            std::rotate(handles.begin(), handles.begin() + 1,
+                        std::lower_bound(handles.begin() + 1, handles.end(), stem_handle, id_order()));
+        }
+    }
+
+    template <typename Visitor>
+    static bool visit(Visitor &visitor, Node const &node, std::size_t depth) {
+        if constexpr (std::is_invocable_v<Visitor &, const Virus &, std::size_t>) {
+            if constexpr (std::is_void_v<std::invoke_result_t<Visitor &, const Virus &, std::size_t>>) {
+                visitor(*node.virus, depth);
+                return true;
+            } else {
+                return static_cast<bool>(visitor(*node.virus, depth));
+            }
+        } else if constexpr (std::is_void_v<std::invoke_result_t<Visitor &, const Virus &>>) {
+            visitor(*node.virus);
+            return true;
+        } else {
+            return static_cast<bool>(visitor(*node.virus));
+        }
+    }
+
+    // Visits every node reachable from start along the given adjacency
+    // (children or parents), excluding start itself. Works on handles only
+    // and borrows its visited bitmap and frontier from the thread's scratch.
+    // Topological order first collects the nodes breadth-first.
+    template <typename Visitor>
+    bool traverse(handle_type start, std::vector<handle_type> Node::*edges, Visitor &visitor,
+                  TraversalOrder order, std::size_t max_depth) const {
+        virus_genealogy_detail::ScratchLease lease;
+        auto &visited = (*lease).visited;
+        auto &frontier = (*lease).frontier;
+
+        if (order != TraversalOrder::depth_first) {
+            bool topological = order == TraversalOrder::topological;
+            visited.insert(start);
+            frontier.emplace_back(start, 0);
+
+            for (std::size_t i = 0; i < frontier.size(); ++i) {
+                auto [handle, depth] = frontier[i];
+                if (i > 0 && !topological && !visit(visitor, state->nodes[handle], depth)) {
+                    return false;
+                }
+                if (depth == max_depth) {
+                    continue;
+                }
+                for (handle_type next : state->nodes[handle].*edges) {
+                    if (visited.insert(next)) {
+                        frontier.emplace_back(next, depth + 1);
+                    }
+                }
+            }
+            return !topological || visit_topologically(frontier, visitor);
+        }
+
+        frontier.emplace_back(start, 0);
+        while (!frontier.empty()) {
+            auto [handle, depth] = frontier.back();
+            frontier.pop_back();
+            if (!visited.insert(handle)) {
+                continue;
+            }
+            if (handle != start && !visit(visitor, state->nodes[handle], depth)) {
+                return false;
+            }
+            if (depth == max_depth) {
+                continue;
+            }
+            auto const &next_handles = state->nodes[handle].*edges;
+            for (auto it = next_handles.rbegin(); it != next_handles.rend(); ++it) {
+                if (!visited.contains(*it)) {
+                    frontier.emplace_back(*it, depth + 1);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Kahn's algorithm over the nodes collected by a breadth-first traversal
+    // (frontier[0] is the start node and is not visited): a node is visited
+    // once all its parents among the collected nodes have been.
+    template <typename Visitor>
+    bool visit_topologically(std::vector<std::pair<handle_type, std::uint32_t>> const &frontier,
+                             Visitor &visitor) const {
+        virus_genealogy_detail::HashTable<handle_type, std::uint32_t> positions;
+        positions.reserve(frontier.size());
+        for (std::size_t i = 1; i < frontier.size(); ++i) {
+            positions.insert(frontier[i].first, static_cast<std::uint32_t>(i));
+        }
+
+        std::vector<std::uint32_t> waiting_for(frontier.size(), 0);
+        std::vector<std::uint32_t> ready;
+        ready.reserve(frontier.size());
+
+        for (std::size_t i = 1; i < frontier.size(); ++i) {
+            for (handle_type parent : state->nodes[frontier[i].first].parents) {
+                if (positions.find(parent) != nullptr) {
+                    ++waiting_for[i];
+                }
+            }
+            if (waiting_for[i] == 0) {
+                ready.push_back(static_cast<std::uint32_t>(i));
+            }
+        }
+
+        for (std::size_t i = 0; i < ready.size(); ++i) {
+            auto [handle, depth] = frontier[ready[i]];
+            if (!visit(visitor, state->nodes[handle], depth)) {
+                return false;
+            }
+            for (handle_type child : state->nodes[handle].children) {
+                std::uint32_t const *position = positions.find(child);
+                if (position != nullptr && --waiting_for[*position] == 0) {
+                    ready.push_back(*position);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Reachability labels in the style of GRAIL, computed by several
+    // depth-first traversals from the stem with randomised child order.
+    // For every traversal, low..post of a node contains the post-order
+    // numbers of all its descendants, so a label that is not contained
+    // proves unreachability, as does a level (longest distance from the
+    // stem) that does not increase. The first traversal also records the
+    // preorder interval of every node in its DFS tree, which proves
+    // reachability. Only queries that no label decides fall back to a
+    // search pruned by the same labels. All labels of a node share one
+    // record, so a check costs a single cache line per node.
+    struct ReachabilityIndex {
+        static constexpr std::size_t traversals = 3;
+
+        struct Label {
+            std::uint32_t pre;
+            std::uint32_t pre_end;
+            std::uint32_t level;
+            std::array<std::uint32_t, traversals> low;
+            std::array<std::uint32_t, traversals> post;
+        };
+
+        std::vector<Label> labels;
+
+        bool may_reach(handle_type from, handle_type to) const noexcept {
+            Label const &a = labels[from];
+            Label const &b = labels[to];
+            if (a.level >= b.level) {
+                return false;
+            }
+            for (std::size_t k = 0; k < traversals; ++k) {
+                if (a.low[k] > b.low[k] || b.post[k] > a.post[k]) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool tree_reaches(handle_type from, handle_type to) const noexcept {
+            Label const &a = labels[from];
+            std::uint32_t pre = labels[to].pre;
+            return a.pre <= pre && pre < a.pre_end;
+        }
+    };
+
+    ReachabilityIndex const &reachability_index() const {
+        return reachability.get([this] { return build_reachability(); });
+    }
+
+    ReachabilityIndex build_reachability() const {
+        ReachabilityIndex result;
+        auto &labels = result.labels;
+        labels.resize(state->nodes.size());
+
+        // The traversals run on a flat copy of the child lists.
+        std::vector<std::uint32_t> offsets(state->nodes.size() + 1, 0);
+        for (std::size_t i = 0; i < state->nodes.size(); ++i) {
+            offsets[i + 1] = offsets[i] + static_cast<std::uint32_t>(state->nodes[i].children.size());
+        }
+        std::vector<handle_type> targets;
+        targets.reserve(offsets.back());
+        for (std::size_t i = 0; i < state->nodes.size(); ++i) {
+            auto const &children = state->nodes[i].children;
+            targets.insert(targets.end(), children.begin(), children.end());
+        }
+
+        std::minstd_rand random;
+        std::vector<std::uint8_t> seen;
+        std::vector<handle_type> post_order;
+        struct Frame {
+            handle_type handle;
+            std::uint32_t offset;
+            std::uint32_t next;
+        };
+        std::vector<Frame> stack;
+
+        for (std::size_t k = 0; k < ReachabilityIndex::traversals; ++k) {
+            seen.assign(state->nodes.size(), 0);
+            std::uint32_t pre_counter = 0;
+            std::uint32_t post_counter = 0;
+
+            auto enter = [&](handle_type handle) {
+                seen[handle] = 1;
+                labels[handle].low[k] = std::numeric_limits<std::uint32_t>::max();
+                if (k == 0) {
+                    labels[handle].pre = pre_counter++;
+                }
+                std::uint32_t degree = offsets[handle + 1] - offsets[handle];
+                std::uint32_t offset = k == 0 || degree == 0 ? 0 : random() % degree;
+                stack.push_back({handle, offset, 0});
+            };
+
+            enter(stem_handle);
+            while (!stack.empty()) {
+                Frame &frame = stack.back();
+                std::uint32_t begin = offsets[frame.handle];
+                std::uint32_t degree = offsets[frame.handle + 1] - begin;
+                if (frame.next < degree) {
+                    std::uint32_t i = frame.offset + frame.next++;
+                    handle_type child = targets[begin + (i < degree ? i : i - degree)];
+                    if (!seen[child]) {
+                        enter(child);
+                    } else {
+                        labels[frame.handle].low[k] =
+                            std::min(labels[frame.handle].low[k], labels[child].low[k]);
+                    }
+                    continue;
+                }
+
+                auto &label = labels[frame.handle];
+                label.post[k] = post_counter++;
+                label.low[k] = std::min(label.low[k], label.post[k]);
+                if (k == 0) {
+                    label.pre_end = pre_counter;
+                    post_order.push_back(frame.handle);
+                }
+                std::uint32_t low = label.low[k];
+                stack.pop_back();
+                if (!stack.empty()) {
+                    auto &parent_low = labels[stack.back().handle].low[k];
+                    parent_low = std::min(parent_low, low);
+                }
+            }
+        }
+
+        // Reverse post-order is a topological order.
+        for (auto it = post_order.rbegin(); it != post_order.rend(); ++it) {
+            std::uint32_t level = 0;
+            for (handle_type parent : state->nodes[*it].parents) {
+                level = std::max(level, labels[parent].level + 1);
+            }
+            labels[*it].level = level;
+        }
+
+        return result;
+    }
+
+    // Searches down from `from` and up from `to`, pruned by the labels,
+    // always extending the search that has scanned fewer edges so far.
+    // Either search alone decides the query, so the cost is bounded by twice
+    // the smaller one, which in a genealogy is usually the ancestry of `to`.
+    bool reaches(ReachabilityIndex const &index, handle_type from, handle_type to) const {
+        if (index.tree_reaches(from, to)) {
+            return true;
+        }
+        if (!index.may_reach(from, to)) {
+            return false;
+        }
+
+        virus_genealogy_detail::ScratchLease down_lease;
+        virus_genealogy_detail::ScratchLease up_lease;
+        auto &down_visited = (*down_lease).visited;
+        auto &down = (*down_lease).frontier;
+        auto &up_visited = (*up_lease).visited;
+        auto &up = (*up_lease).frontier;
+        down_visited.insert(from);
+        down.emplace_back(from, 0);
+        up_visited.insert(to);
+        up.emplace_back(to, 0);
+        std::size_t down_edges = 0;
+        std::size_t up_edges = 0;
+
+        while (!down.empty() && !up.empty()) {
+            if (down_edges <= up_edges) {
+                handle_type handle = down.back().first;
+                down.pop_back();
+                auto const &children = state->nodes[handle].children;
+                down_edges += children.size();
+                for (handle_type child : children) {
+                    if (child == to || index.tree_reaches(child, to)) {
+                        return true;
+                    }
+                    if (index.may_reach(child, to) && down_visited.insert(child)) {
+                        down.emplace_back(child, 0);
+                    }
+                }
+            } else {
+                handle_type handle = up.back().first;
+                up.pop_back();
+                auto const &parents = state->nodes[handle].parents;
+                up_edges += parents.size();
+                for (handle_type parent : parents) {
+                    if (parent == from || index.tree_reaches(from, parent)) {
+                        return true;
+                    }
+                    if (index.may_reach(from, parent) && up_visited.insert(parent)) {
+                        up.emplace_back(parent, 0);
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    // Dominator tree rooted at the stem, with preorder intervals so that
+    // dominance is an interval check.
+    struct DominatorTree {
+        std::vector<handle_type> idom;
+        std::vector<std::uint32_t> pre;
+        std::vector<std::uint32_t> pre_end;
+
+        bool contains(handle_type dominator, handle_type handle) const noexcept {
+            return pre[dominator] <= pre[handle] && pre[handle] < pre_end[dominator];
+        }
+    };
+
+    DominatorTree const &dominator_tree() const {
+        return dominators.get([this] { return build_dominator_tree(); });
+    }
+
+    // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm":
+    // iterate idom(v) = intersection of idom over processed parents, in
+    // reverse post-order, until nothing changes. One or two passes suffice
+    // for the shallow, mostly tree-like graphs a genealogy forms.
+    DominatorTree build_dominator_tree() const {
+        constexpr std::uint32_t unreached = std::numeric_limits<std::uint32_t>::max();
+        std::size_t size = state->nodes.size();
+
+        std::vector<std::uint32_t> post(size, unreached);
+        std::vector<handle_type> post_order;
+        std::vector<std::pair<handle_type, std::uint32_t>> stack{{stem_handle, 0}};
+        std::vector<std::uint8_t> seen(size, 0);
+        seen[stem_handle] = 1;
+
+        while (!stack.empty()) {
+            auto &[handle, next] = stack.back();
+            auto const &children = state->nodes[handle].children;
+            if (next < children.size()) {
+                handle_type child = children[next++];
+                if (!seen[child]) {
+                    seen[child] = 1;
+                    stack.emplace_back(child, 0);
+                }
+                continue;
+            }
+            post[handle] = static_cast<std::uint32_t>(post_order.size());
+            post_order.push_back(handle);
+            stack.pop_back();
+        }
+
+        DominatorTree tree;
+        auto &idom = tree.idom;
+        idom.assign(size, stem_handle);
+        std::vector<std::uint8_t> done(size, 0);
+        done[stem_handle] = 1;
+
+        auto intersect = [&](handle_type a, handle_type b) {
+            while (a != b) {
+                while (post[a] < post[b]) {
+                    a = idom[a];
+                }
+                while (post[b] < post[a]) {
+                    b = idom[b];
+                }
+            }
+            return a;
+        };
+
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto it = post_order.rbegin(); it != post_order.rend(); ++it) {
+                handle_type handle = *it;
+                if (handle == stem_handle) {
+                    continue;
+                }
+                std::optional<handle_type> dominator;
+                for (handle_type parent : state->nodes[handle].parents) {
+                    if (!done[parent] || post[parent] == unreached) {
+                        continue;
+                    }
+                    dominator = dominator ? intersect(parent, *dominator) : parent;
+                }
+                if (dominator && (!done[handle] || idom[handle] != *dominator)) {
+                    idom[handle] = *dominator;
+                    done[handle] = 1;
+                    changed = true;
+                }
+            }
+        }
+
+        // Preorder numbering of the dominator tree, built as flat child lists.
+        std::vector<std::uint32_t> offsets(size + 1, 0);
+        for (handle_type handle : post_order) {
+            if (handle != stem_handle) {
+                ++offsets[idom[handle] + 1];
+            }
+        }
+        for (std::size_t i = 0; i < size; ++i) {
+            offsets[i + 1] += offsets[i];
+        }
+        std::vector<handle_type> children(offsets.back());
+        std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (handle_type handle : post_order) {
+            if (handle != stem_handle) {
+                children[fill[idom[handle]]++] = handle;
+            }
+        }
+
+        tree.pre.assign(size, 0);
+        tree.pre_end.assign(size, 0);
+        std::uint32_t counter = 0;
+        stack.assign(1, {stem_handle, 0});
+        tree.pre[stem_handle] = counter++;
+        while (!stack.empty()) {
+            auto &[handle, next] = stack.back();
+            if (offsets[handle] + next < offsets[handle + 1]) {
+                handle_type child = children[offsets[handle] + next++];
+                tree.pre[child] = counter++;
+                stack.emplace_back(child, 0);
+                continue;
+            }
+            tree.pre_end[handle] = counter;
+            stack.pop_back();
+        }
+
+        return tree;
+    }
+
+    // Edges into viruses with a single parent form a forest, rooted at the
+    // stem and the viruses with several parents. Within a tree ancestry is
+    // exact and a preorder interval check. Skew-binary jump pointers (Myers,
+    // "An applicative random-access stack") find the deepest tree ancestor
+    // satisfying a monotone predicate in O(log depth) evaluations.
+    struct LcaForest {
+        struct Entry {
+            handle_type parent;  // The root is its own parent and jump.
+            handle_type jump;
+            handle_type root;
+            std::uint32_t depth;
+            std::uint32_t pre;
+            std::uint32_t pre_end;
+        };
+
+        std::vector<Entry> entries;
+
+        bool tree_contains(handle_type ancestor, handle_type handle) const noexcept {
+            std::uint32_t pre = entries[handle].pre;
+            return entries[ancestor].pre <= pre && pre < entries[ancestor].pre_end;
+        }
+
+        // The deepest strict tree ancestor of handle for which holds() is true,
+        // where holds() stays true going up from any node it is true for.
+        template <typename Holds>
+        std::optional<handle_type> deepest_ancestor(handle_type handle, Holds &&holds) const {
+            handle_type root = entries[handle].root;
+            while (handle != root) {
+                Entry const &entry = entries[handle];
+                if (entry.jump != entry.parent && !holds(entry.jump)) {
+                    handle = entry.jump;
+                    continue;
+                }
+                if (holds(entry.parent)) {
+                    return entry.parent;
+                }
+                handle = entry.parent;
+            }
+            return std::nullopt;
+        }
+    };
+
+    LcaForest const &lca_forest() const {
+        return lca_forests.get([this] { return build_lca_forest(); });
+    }
+
+    LcaForest build_lca_forest() const {
+        LcaForest forest;
+        auto &entries = forest.entries;
+        entries.resize(state->nodes.size());
+        std::uint32_t counter = 0;
+        std::vector<std::pair<handle_type, std::uint32_t>> stack;
+
+        for (std::size_t i = 0; i < state->nodes.size(); ++i) {
+            auto root = static_cast<handle_type>(i);
+            if (state->nodes[root].virus == nullptr || state->nodes[root].parents.size() == 1) {
+                continue;
+            }
+            entries[root] = {root, root, root, 0, counter++, 0};
+            stack.emplace_back(root, 0);
+            while (!stack.empty()) {
+                auto &[handle, next] = stack.back();
+                auto const &children = state->nodes[handle].children;
+                if (next < children.size()) {
+                    handle_type child = children[next++];
+                    if (state->nodes[child].parents.size() == 1) {
+                        auto const &parent = entries[handle];
+                        auto const &jump = entries[parent.jump];
+                        bool skew = parent.depth - jump.depth == jump.depth - entries[jump.jump].depth;
+                        entries[child] = {handle, skew ? jump.jump : handle, parent.root, parent.depth + 1,
+                                          counter++, 0};
+                        stack.emplace_back(child, 0);
+                    }
+                    continue;
+                }
+                entries[handle].pre_end = counter;
+                stack.pop_back();
+            }
+        }
+
+        return forest;
+    }
+
+    // Dynamic topological order (Pearce and Kelly, "A Dynamic Topological
+    // Sort Algorithm for Directed Acyclic Graphs"). slots lists handles by
+    // position, with holes left by removed nodes; position is the inverse.
+    struct TopologicalOrder {
+        static constexpr handle_type hole = std::numeric_limits<handle_type>::max();
+
+        bool enabled = false;
+        std::vector<std::uint32_t> position;
+        std::vector<handle_type> slots;
+        std::size_t holes = 0;
+    };
+
+    // Kahn's algorithm over all nodes. Nodes on a cycle are left out.
+    std::vector<handle_type> sorted_topologically() const {
+        std::vector<handle_type> result;
+        result.reserve(state->index.size());
+        std::vector<std::uint32_t> waiting_for(state->nodes.size(), 0);
+
+        for (std::size_t i = 0; i < state->nodes.size(); ++i) {
+            waiting_for[i] = static_cast<std::uint32_t>(state->nodes[i].parents.size());
+            if (state->nodes[i].virus != nullptr && waiting_for[i] == 0) {
+                result.push_back(static_cast<handle_type>(i));
+            }
+        }
+        for (std::size_t i = 0; i < result.size(); ++i) {
+            for (handle_type child : state->nodes[result[i]].children) {
+                if (--waiting_for[child] == 0) {
+                    result.push_back(child);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    // Makes room for a node appended by create_node().
+    void reserve_order(std::size_t handles) {
+        if (!topological.enabled) {
+            return;
+        }
+        if (topological.position.size() < handles) {
+            topological.position.resize(std::max(handles, 2 * topological.position.size()), 0);
+        }
+        if (topological.slots.capacity() == topological.slots.size()) {
+            topological.slots.reserve(std::max<std::size_t>(16, 2 * topological.slots.capacity()));
+        }
+    }
+
+    // Never allocates: slots only grows by one past a reserve_order() call.
+    void place_in_order(handle_type handle, std::uint32_t position) noexcept {
+        if (position == topological.slots.size()) {
+            topological.slots.push_back(handle);
+        } else {
+            topological.slots[position] = handle;
+        }
+        topological.position[handle] = position;
+    }
+
+    void erase_from_order(handle_type handle) noexcept {
+        if (!topological.enabled) {
+            return;
+        }
+        topological.slots[topological.position[handle]] = TopologicalOrder::hole;
+        ++topological.holes;
+
+        if (topological.holes > topological.slots.size() / 2) {
+            std::size_t kept = 0;
+            for (handle_type slot : topological.slots) {
+                if (slot != TopologicalOrder::hole) {
+                    topological.slots[kept] = slot;
+                    topological.position[slot] = static_cast<std::uint32_t>(kept);
+                    ++kept;
+                }
+            }
+            topological.slots.resize(kept);
+            topological.holes = 0;
+        }
+    }
+
+    // New positions that keep the order topological once the edge
+    // parent -> child is added; empty if it already is. Only the nodes with
+    // positions between the child's and the parent's are searched: those
+    // reachable from the child move after those reaching the parent,
+    // reusing the same set of positions. Throws TriedToCreateCycle if the
+    // child reaches the parent.
+    std::vector<std::pair<handle_type, std::uint32_t>> plan_reordering(handle_type parent,
+                                                                      handle_type child) const {
+        std::vector<std::pair<handle_type, std::uint32_t>> result;
+        if (!topological.enabled) {
+            return result;
+        }
+        if (parent == child) {
+            throw TriedToCreateCycle();
+        }
+
+        auto const &position = topological.position;
+        std::uint32_t lower = position[child];
+        std::uint32_t upper = position[parent];
+        if (upper < lower) {
+            return result;
+        }
+
+        virus_genealogy_detail::ScratchLease lease;
+        auto &visited = (*lease).visited;
+        auto &stack = (*lease).frontier;
+        auto search = [&](handle_type start, std::vector<handle_type> Node::*edges, auto in_range) {
+            std::size_t first = result.size();
+            visited.insert(start);
+            stack.emplace_back(start, 0);
+            while (!stack.empty()) {
+                handle_type handle = stack.back().first;
+                stack.pop_back();
+                result.emplace_back(handle, position[handle]);
+                for (handle_type next : state->nodes[handle].*edges) {
+                    if (next == parent && edges == &Node::children) {
+                        throw TriedToCreateCycle();
+                    }
+                    if (in_range(position[next]) && visited.insert(next)) {
+                        stack.emplace_back(next, 0);
+                    }
+                }
+            }
+            std::sort(result.begin() + first, result.end(),
+                      [](auto const &a, auto const &b) { return a.second < b.second; });
+        };
+
+        search(child, &Node::children, [upper](std::uint32_t p) { return p < upper; });
+        std::size_t forward = result.size();
+        search(parent, &Node::parents, [lower](std::uint32_t p) { return p > lower; });
+
+        // Backward set first, then the forward set, each in its old order.
+        std::rotate(result.begin(), result.begin() + forward, result.end());
+        std::vector<std::uint32_t> positions(result.size());
+        std::transform(result.begin(), result.end(), positions.begin(),
+                       [](auto const &entry) { return entry.second; });
+        std::sort(positions.begin(), positions.end());
+        for (std::size_t i = 0; i < result.size(); ++i) {
+            result[i].second = positions[i];
+        }
+
+        return result;
+    }
+
+    // generation_of returns nullptr for parents that no longer count.
+    template <typename GenerationOf>
+    Generation generation_from_parents(handle_type handle, GenerationOf generation_of,
+                                       std::pair<handle_type, handle_type> extra_edge = {0, 0}) const {
+        if (handle == stem_handle) {
+            return {};
+        }
+
+        Generation result{std::numeric_limits<std::uint32_t>::max(), 0};
+        auto add_parent = [&](handle_type parent) {
+            if (Generation const *generation = generation_of(parent)) {
+                result.shortest = std::min(result.shortest, generation->shortest + 1);
+                result.longest = std::max(result.longest, generation->longest + 1);
+            }
+        };
+        for (handle_type parent : state->nodes[handle].parents) {
+            add_parent(parent);
+        }
+        if (extra_edge.second == handle) {
+            add_parent(extra_edge.first);
+        }
+
+        return result;
+    }
+
+    // New generations after a mutation that changes the parents of the
+    // given roots: the removed nodes stop counting as parents and
+    // extra_edge (parent, child) is about to be added. Returns only the
+    // nodes whose generation changes; propagation stops at children that
+    // keep theirs. Nodes are visited by their old longest generation, which
+    // still orders every parent before its children. Does not modify the
+    // genealogy.
+    template <typename Removed>
+    std::vector<std::pair<handle_type, Generation>> plan_generations(
+        std::vector<handle_type> const &roots, Removed removed,
+        std::pair<handle_type, handle_type> extra_edge = {0, 0}) const {
+        std::vector<std::pair<handle_type, Generation>> result;
+        virus_genealogy_detail::HashTable<handle_type, std::uint32_t> slot;
+        virus_genealogy_detail::ScratchLease lease;
+        auto &queued = (*lease).visited;
+        std::vector<std::pair<std::uint32_t, handle_type>> heap;
+
+        auto current = [&](handle_type parent) -> Generation const * {
+            if (removed(parent)) {
+                return nullptr;
+            }
+            std::uint32_t const *i = slot.find(parent);
+            return i == nullptr ? &state->nodes[parent].generation : &result[*i].second;
+        };
+        auto enqueue = [&](handle_type handle) {
+            if (queued.insert(handle)) {
+                heap.emplace_back(state->nodes[handle].generation.longest, handle);
+                std::push_heap(heap.begin(), heap.end(), std::greater<>());
+            }
+        };
+
+        for (handle_type root : roots) {
+            enqueue(root);
+        }
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+            handle_type handle = heap.back().second;
+            heap.pop_back();
+
+            Generation generation = generation_from_parents(handle, current, extra_edge);
+            if (generation != state->nodes[handle].generation) {
+                slot.insert(handle, static_cast<std::uint32_t>(result.size()));
+                result.emplace_back(handle, generation);
+                for (handle_type child : state->nodes[handle].children) {
+                    enqueue(child);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    // The given nodes and their ancestors, walking up until closed nodes,
+    // whose ancestors are all closed as well.
+    std::vector<handle_type> unclosed_ancestors(std::vector<handle_type> const &starts) const {
+        std::vector<handle_type> result;
+        virus_genealogy_detail::ScratchLease lease;
+        auto &visited = (*lease).visited;
+
+        for (handle_type start : starts) {
+            if (clades[start].state != CladeState::closed && visited.insert(start)) {
+                result.push_back(start);
+            }
+        }
+        for (std::size_t i = 0; i < result.size(); ++i) {
+            for (handle_type parent : state->nodes[result[i]].parents) {
+                if (clades[parent].state != CladeState::closed && visited.insert(parent)) {
+                    result.push_back(parent);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    void close_all_clades() noexcept {
+        for (Clade &clade : clades) {
+            clade.state = CladeState::closed;
+        }
+    }
+
+    // Handles grouped by depth in no particular order, with the position
+    // of each handle in its group, so that a node changes groups in O(1).
+    struct DepthBuckets {
+        std::vector<std::vector<handle_type>> members;
+        std::vector<std::uint32_t> position;
+
+        void insert(handle_type handle, std::uint32_t depth) {
+            if (members.size() <= depth) {
+                members.resize(depth + 1);
+            }
+            if (position.size() <= handle) {
+                position.resize(std::max<std::size_t>(handle + 1, 2 * position.size()), 0);
+            }
+            members[depth].push_back(handle);
+            position[handle] = static_cast<std::uint32_t>(members[depth].size() - 1);
+        }
+
+        void erase(handle_type handle, std::uint32_t depth) noexcept {
+            auto &bucket = members[depth];
+            handle_type last = bucket.back();
+            bucket[position[handle]] = last;
+            position[last] = position[handle];
+            bucket.pop_back();
+        }
+    };
+
+    DepthBuckets build_depth_buckets(std::uint32_t Generation::*kind) const {
+        DepthBuckets buckets;
+        buckets.position.resize(state->nodes.size(), 0);
+
+        for (std::size_t i = 0; i < state->nodes.size(); ++i) {
+            if (state->nodes[i].virus != nullptr) {
+                buckets.insert(static_cast<handle_type>(i), state->nodes[i].generation.*kind);
+            }
+        }
+
+        return buckets;
+    }
+
+    // Keeps the built depth buckets in step with a generation change; an
+    // empty generation stands for a node being created or released.
+    // Buckets that fail to grow are dropped and rebuilt by the next query.
+    void move_between_depths(handle_type handle, std::optional<Generation> from,
+                             std::optional<Generation> to) noexcept {
+        auto move = [&](virus_genealogy_detail::LazyIndex<DepthBuckets> &index,
+                        std::uint32_t Generation::*kind) {
+            DepthBuckets *buckets = index.built();
+            if (buckets == nullptr || (from && to && (*from).*kind == (*to).*kind)) {
+                return;
+            }
+            if (from) {
+                buckets->erase(handle, (*from).*kind);
+            }
+            try {
+                if (to) {
+                    buckets->insert(handle, (*to).*kind);
+                }
+            } catch (std::exception &e) {
+                index.invalidate();
+            }
+        };
+        move(shortest_buckets, &Generation::shortest);
+        move(longest_buckets, &Generation::longest);
+    }
+
+    // Nodes per task of the parallel traversals.
+    static constexpr std::size_t parallel_grain = 1024;
+
+    // "VGEN" in the first four bytes of a saved file.
+    static constexpr std::uint32_t file_magic = 0x4E454756;
+    static constexpr std::uint32_t file_version = 1;
+
+    // Called after every successful mutation.
+    void invalidate_indexes() noexcept {
+        reachability.invalidate();
+        dominators.invalidate();
+        lca_forests.invalidate();
+    }
+
+    using Cascade = virus_genealogy_detail::Cascade<
+        handle_type, virus_genealogy_detail::HashTable<handle_type, std::uint32_t>>;
+
+    // Does not modify the genealogy.
+    Cascade collect_cascade(handle_type handle) const {
+        return Cascade::collect(
+            handle, stem_handle,
+            [this](handle_type removed) -> std::vector<handle_type> const & {
+                return state->nodes[removed].children;
+            },
+            [this](handle_type child) { return state->nodes[child].parents.size(); });
+    }
+
+    Cascade removal_cascade(typename Virus::id_type const &id) const {
+        if (id == stem_id) {
+            throw TriedToRemoveStemVirus();
+        }
+
+        return collect_cascade(find_handle(id));
+    }
+
+    // Everything a snapshot shares with the genealogy it was taken from.
+    struct State {
+        NodeArray nodes;
+        // Released slots, linked through Node::next_free.
+        handle_type free_head = no_handle;
+        std::size_t free_count = 0;
+        typename Storage::template table<typename Virus::id_type, handle_type> index{};
+
+        std::shared_ptr<Virus> const &virus_of(handle_type handle) const noexcept {
+            return nodes[handle].virus;
+        }
+
+        typename Virus::id_type const &id_of(handle_type handle) const noexcept {
+            return nodes[handle].id;
+        }
+    };
+
+    // Snapshots get their own lazily built indexes and descendant counts.
+    VirusGenealogy(typename Virus::id_type const &stem_id, std::shared_ptr<State> state)
+        : stem_id(stem_id), state(std::move(state)) {
+    }
+
+    // Takes over a state built from scratch, as by load(). Mutations index
+    // clades by handle, so unlike a snapshot it needs them sized up front.
+    VirusGenealogy(typename Virus::id_type const &stem_id, std::unique_ptr<State> state)
+        : stem_id(stem_id), state(std::move(state)) {
+        reserve_nodes(this->state->nodes.size());
+        clades.resize(this->state->nodes.size(), Clade{0, CladeState::closed});
+    }
+
+    // Copy-on-write: the first mutation after a snapshot copies the state,
+    // which shares its pages with the snapshot (see PagedArray).
+    // Checking state.use_count() instead would race: a reader dropping its
+    // snapshot on another thread is not ordered before the check.
+    void detach() {
+        if (shared.load(std::memory_order_relaxed)) {
+            state = std::make_shared<State>(*state);
+            shared.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    typename Virus::id_type const stem_id;
+    std::shared_ptr<State> state = std::make_shared<State>();
+    mutable std::atomic<bool> shared{false};
+    TopologicalOrder topological;
+    // Not shared with snapshots: queries on a snapshot fill in their own.
+    mutable std::vector<Clade> clades;
+    virus_genealogy_detail::LazyIndex<ReachabilityIndex> reachability;
+    virus_genealogy_detail::LazyIndex<DominatorTree> dominators;
+    virus_genealogy_detail::LazyIndex<LcaForest> lca_forests;
+    virus_genealogy_detail::LazyIndex<DepthBuckets> shortest_buckets;
+    virus_genealogy_detail::LazyIndex<DepthBuckets> longest_buckets;
+    mutable std::mutex clade_mutex;
+};
+
+// Niezmienna genealogia w postaci CSR, tworzona przez
+// VirusGenealogy::freeze(). Udostępnia te same zapytania co VirusGenealogy,
+// przy znacznie mniejszym zużyciu pamięci.
+template <typename Virus, typename Storage>
+class FrozenVirusGenealogy {
+  public:
+    using Iterator = virus_genealogy_detail::IndexIterator<
+        FrozenVirusGenealogy, virus_genealogy_detail::VirusProjection<Virus>>;
+    using children_iterator = Iterator;
+    using ChildrenView = typename VirusGenealogy<Virus, Storage>::template HandleView<children_iterator>;
+
+    using ParentIterator = virus_genealogy_detail::IndexIterator<
+        FrozenVirusGenealogy, virus_genealogy_detail::IdProjection<typename Virus::id_type>>;
+    using parents_iterator = ParentIterator;
+    using ParentsView = typename VirusGenealogy<Virus, Storage>::template HandleView<parents_iterator>;
+
+    typename Virus::id_type get_stem_id() const noexcept {
+        return stem_id;
+    }
+
+    // Zwraca liczbę wirusów w genealogii.
+    std::size_t size() const noexcept {
+        return ids.size();
+    }
+
+    bool exists(typename Virus::id_type const &id) const noexcept {
+        return index.find(id) != nullptr;
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli żądany wirus nie istnieje.
+    const Virus &operator[](typename Virus::id_type const &id) const {
+        return *viruses[find_node(id)];
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    children_iterator get_children_begin(typename Virus::id_type const &id) const {
+        return children_iterator(children_targets.data() + child_offsets[find_node(id)], *this);
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    children_iterator get_children_end(typename Virus::id_type const &id) const {
+        return children_iterator(children_targets.data() + child_offsets[find_node(id) + 1], *this);
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    ChildrenView children(typename Virus::id_type const &id) const {
+        std::uint32_t node = find_node(id);
+        return ChildrenView(children_iterator(children_targets.data() + child_offsets[node], *this),
+                            children_iterator(children_targets.data() + child_offsets[node + 1], *this));
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::vector<typename Virus::id_type> get_parents(typename Virus::id_type const &id) const {
+        ParentsView view = parents(id);
+        return std::vector<typename Virus::id_type>(view.begin(), view.end());
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    ParentsView parents(typename Virus::id_type const &id) const {
+        std::uint32_t node = find_node(id);
+        return ParentsView(parents_iterator(parent_targets.data() + parent_offsets[node], *this),
+                           parents_iterator(parent_targets.data() + parent_offsets[node + 1], *this));
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::size_t children_count(typename Virus::id_type const &id) const {
+        std::uint32_t node = find_node(id);
+        return child_offsets[node + 1] - child_offsets[node];
+    }
+
+    // Zgłasza wyjątek VirusNotFound, jeśli dany wirus nie istnieje.
+    std::size_t parents_count(typename Virus::id_type const &id) const {
+        std::uint32_t node = find_node(id);
+        return parent_offsets[node + 1] - parent_offsets[node];
+    }
+
+  private:
+    friend class VirusGenealogy<Virus, Storage>;
+    friend struct virus_genealogy_detail::VirusProjection<Virus>;
+    friend struct virus_genealogy_detail::IdProjection<typename Virus::id_type>;
+
+    explicit FrozenVirusGenealogy(typename Virus::id_type const &stem_id) : stem_id(stem_id) {
+    }
+
+    std::shared_ptr<Virus> const &virus_of(std::uint32_t node) const noexcept {
+        return viruses[node];
+    }
+
+    typename Virus::id_type const &id_of(std::uint32_t node) const noexcept {
+        return ids[node];
+    }
+
+    std::uint32_t find_node(typename Virus::id_type const &id) const {
+        std::uint32_t const *node = index.find(id);
+        if (node == nullptr) {
+            throw VirusNotFound();
+        }
+
+        return *node;
+    }
+
+    typename Virus::id_type stem_id;
+    // Nodes are numbered in breadth-first order from the stem, which is 0.
+    // The neighbours of node i are targets[offsets[i]] .. targets[offsets[i + 1] - 1],
+    // sorted by id.
+    std::vector<std::uint32_t> child_offsets;
+    std::vector<std::uint32_t> children_targets;
+    std::vector<std::uint32_t> parent_offsets;
+    std::vector<std::uint32_t> parent_targets;
+    std::vector<typename Virus::id_type> ids;
+    std::vector<std::shared_ptr<Virus>> viruses;
+    typename Storage::template table<typename Virus::id_type, std::uint32_t> index{};
 };
 
 #endif // VIRUS_GENEALOGY_H
@@ -0,0 +1,229 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Pula wątków z podkradaniem zadań, na której działają równoległe
+// przeglądania genealogii. Każdy wątek ma własną kolejkę: zadania dzieli
+// i wykonuje od jej końca, a bezczynne wątki podkradają zadania z początku
+// cudzych kolejek. Wątek wywołujący parallel_for() także wykonuje zadania.
+class WorkStealingPool {
+  public:
+    // Tworzy pulę z podaną liczbą wątków roboczych; domyślnie o jeden mniej
+    // niż wątków sprzętowych, bo wątek wywołujący też pracuje. Pula bez
+    // wątków roboczych wykonuje wszystko w wątku wywołującym.
+    explicit WorkStealingPool(std::size_t threads = default_threads())
+        : thread_count(threads), queues(std::make_unique<Queue[]>(threads + 1)) {
+        workers.reserve(threads);
+        try {
+            for (std::size_t i = 0; i < threads; ++i) {
+                workers.emplace_back([this, i] { work(i); });
+            }
+        } catch (std::exception &e) {
+            shut_down();
+            throw;
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    ~WorkStealingPool() {
+        shut_down();
+    }
+
+    // Wspólna pula używana domyślnie przez równoległe przeglądania.
+    static WorkStealingPool &shared() {
+        static WorkStealingPool pool;
+        return pool;
+    }
+
+    std::size_t size() const noexcept {
+        return thread_count;
+    }
+
+    // Wywołuje body(first, last) dla rozłącznych przedziałów pokrywających
+    // [begin, end), o długości co najwyżej grain, równolegle na wątkach puli,
+    // i czeka na zakończenie wszystkich. Jeśli body zgłosi wyjątek,
+    // pozostałe przedziały są pomijane, a pierwszy wyjątek jest zgłaszany
+    // ponownie w wątku wywołującym.
+    template <typename Body>
+    void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, Body &&body) {
+        if (begin >= end) {
+            return;
+        }
+
+        Job job;
+        job.body = static_cast<void *>(std::addressof(body));
+        job.run = [](void *erased, std::size_t first, std::size_t last) {
+            (*static_cast<std::remove_reference_t<Body> *>(erased))(first, last);
+        };
+        job.grain = std::max<std::size_t>(grain, 1);
+        job.remaining.store(end - begin, std::memory_order_relaxed);
+
+        push(own_queue(), Task{&job, begin, end});
+        while (job.remaining.load(std::memory_order_acquire) != 0) {
+            if (std::optional<Task> task = take(own_queue())) {
+                run(*task);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+
+        if (job.error) {
+            std::rethrow_exception(job.error);
+        }
+    }
+
+  private:
+    struct Job {
+        void *body = nullptr;
+        void (*run)(void *, std::size_t, std::size_t) = nullptr;
+        std::size_t grain = 1;
+        // Items not processed yet; the caller waits for zero and then
+        // destroys the job, so nothing may touch it after the last decrement.
+        std::atomic<std::size_t> remaining{0};
+        std::atomic<bool> failed{false};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    struct Task {
+        Job *job;
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    // Aligned to a cache line, so that neighbouring queues do not share one.
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    static std::size_t default_threads() noexcept {
+        unsigned hardware = std::thread::hardware_concurrency();
+        return hardware > 1 ? hardware - 1 : 0;
+    }
+
+    // Workers own queues 0..size()-1; every other thread submits to the
+    // last one.
+    std::size_t own_queue() const noexcept {
+        return current_pool == this ? current_index : thread_count;
+    }
+
+    void push(std::size_t queue, Task task) {
+        {
+            std::lock_guard<std::mutex> lock(queues[queue].mutex);
+            queues[queue].tasks.push_back(task);
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            queued.fetch_add(1, std::memory_order_relaxed);
+        }
+        wake.notify_one();
+    }
+
+    // The newest task of the own queue, or else the oldest one of another.
+    std::optional<Task> take(std::size_t own) {
+        std::size_t count = thread_count + 1;
+        for (std::size_t k = 0; k < count; ++k) {
+            std::size_t queue = (own + k) % count;
+            std::lock_guard<std::mutex> lock(queues[queue].mutex);
+            auto &tasks = queues[queue].tasks;
+            if (!tasks.empty()) {
+                Task task = k == 0 ? tasks.back() : tasks.front();
+                if (k == 0) {
+                    tasks.pop_back();
+                } else {
+                    tasks.pop_front();
+                }
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    // Splits off the upper halves for other threads, then runs the rest.
+    void run(Task task) {
+        Job &job = *task.job;
+        while (task.end - task.begin > job.grain) {
+            std::size_t middle = task.begin + (task.end - task.begin) / 2;
+            try {
+                push(own_queue(), Task{&job, middle, task.end});
+            } catch (std::exception &e) {
+                break;
+            }
+            task.end = middle;
+        }
+
+        if (!job.failed.load(std::memory_order_relaxed)) {
+            try {
+                job.run(job.body, task.begin, task.end);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(job.error_mutex);
+                if (!job.error) {
+                    job.error = std::current_exception();
+                }
+                job.failed.store(true, std::memory_order_relaxed);
+            }
+        }
+        job.remaining.fetch_sub(task.end - task.begin, std::memory_order_acq_rel);
+    }
+
+    void work(std::size_t index) {
+        current_pool = this;
+        current_index = index;
+
+        while (true) {
+            if (std::optional<Task> task = take(index)) {
+                run(*task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this] { return stopping || queued.load(std::memory_order_relaxed) > 0; });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+    void shut_down() noexcept {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+    inline static thread_local WorkStealingPool const *current_pool = nullptr;
+    inline static thread_local std::size_t current_index = 0;
+
+    std::size_t const thread_count;
+    std::unique_ptr<Queue[]> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    // Incremented under sleep_mutex, so that a worker going to sleep
+    // cannot miss a task pushed in between.
+    std::atomic<std::size_t> queued{0};
+    bool stopping = false;
+};
+
+#endif // WORK_STEALING_POOL_H